@@ -0,0 +1,504 @@
+#ifndef included_cq_containers_h_
+#define included_cq_containers_h_
+
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <utility>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace cq {
+
+/**
+ * Hash function used by hash_index. The generic version runs FNV-1a over the bytes of the key,
+ * which must be a plain (trivially copyable, padding free) type. Specialize it for key types
+ * that are already uniformly random, e.g. by deriving from prehashed.
+ */
+template<typename K> struct hasher {
+    inline uint64_t operator()(const K& key) const {
+        const uint8_t* p = (const uint8_t*)&key;
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < sizeof(K); ++i) {
+            h = (h ^ p[i]) * 0x100000001b3ull;
+        }
+        return h;
+    }
+};
+
+/**
+ * Hash function for keys which are themselves random, such as cryptographic hashes: the first
+ * 8 bytes of the key are used as is.
+ */
+template<typename K> struct prehashed {
+    static_assert(sizeof(K) >= sizeof(uint64_t), "prehashed keys must be at least 8 bytes");
+    inline uint64_t operator()(const K& key) const {
+        uint64_t h;
+        memcpy(&h, &key, sizeof(h));
+        return h;
+    }
+};
+
+/**
+ * A flat, open addressing (linear probing) hash table mapping K to V. Entries live in one
+ * contiguous array, next to a byte array of slot tags holding 7 bits of each entry's hash, so
+ * that most probes of a miss never touch the keys. The table grows by doubling at a load of
+ * 3/4, and erase shifts entries back rather than leaving tombstones. clear() keeps the
+ * capacity, so a cleared index refills without allocating.
+ *
+ * The interface follows std::map / std::unordered_map for the parts in use (count, at, find,
+ * operator[], erase, iteration over pairs with .first/.second), but iteration order is
+ * unspecified, and pointers and iterators are invalidated by any insertion or erase.
+ */
+template<typename K, typename V, typename Hash = hasher<K>>
+class hash_index {
+public:
+    struct value_type {
+        K first;
+        V second;
+    };
+
+    template<typename E, typename I>
+    class iterator_base {
+        friend class hash_index;
+        I* m_index;
+        size_t m_slot;
+        iterator_base(I* index, size_t slot) : m_index(index), m_slot(slot) { skip(); }
+        inline void skip() { while (m_slot < m_index->m_tags.size() && !m_index->m_tags[m_slot]) ++m_slot; }
+    public:
+        inline E& operator*() const { return m_index->m_entries[m_slot]; }
+        inline E* operator->() const { return &m_index->m_entries[m_slot]; }
+        inline iterator_base& operator++() { ++m_slot; skip(); return *this; }
+        inline bool operator==(const iterator_base& other) const { return m_slot == other.m_slot; }
+        inline bool operator!=(const iterator_base& other) const { return m_slot != other.m_slot; }
+    };
+    typedef iterator_base<value_type, hash_index> iterator;
+    typedef iterator_base<const value_type, const hash_index> const_iterator;
+
+private:
+    std::vector<value_type> m_entries;
+    std::vector<uint8_t> m_tags;        //!< 0 = empty slot, otherwise 0x80 | the top 7 bits of the hash
+    size_t m_size;
+    size_t m_mask;
+    Hash m_hash;
+
+    static inline uint8_t tag(uint64_t h) { return 0x80 | (h >> 57); }
+
+    /**
+     * Find the slot holding `key`, or the empty slot where it would be inserted.
+     */
+    inline size_t locate(const K& key, uint64_t h, bool& found) const {
+        uint8_t t = tag(h);
+        for (size_t slot = h & m_mask; ; slot = (slot + 1) & m_mask) {
+            if (!m_tags[slot]) {
+                found = false;
+                return slot;
+            }
+            if (m_tags[slot] == t && m_entries[slot].first == key) {
+                found = true;
+                return slot;
+            }
+        }
+    }
+
+    inline size_t locate(const K& key) const {
+        if (!m_size) return m_tags.size();
+        bool found;
+        size_t slot = locate(key, m_hash(key), found);
+        return found ? slot : m_tags.size();
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<value_type> entries(capacity);
+        std::vector<uint8_t> tags(capacity, 0);
+        entries.swap(m_entries);
+        tags.swap(m_tags);
+        m_mask = capacity - 1;
+        for (size_t i = 0; i < tags.size(); ++i) {
+            if (!tags[i]) continue;
+            uint64_t h = m_hash(entries[i].first);
+            bool found;
+            size_t slot = locate(entries[i].first, h, found);
+            m_tags[slot] = tags[i];
+            m_entries[slot] = std::move(entries[i]);
+        }
+    }
+
+public:
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    hash_index() : m_entries(MIN_CAPACITY), m_tags(MIN_CAPACITY, 0), m_size(0), m_mask(MIN_CAPACITY - 1) {}
+
+    inline size_t size() const { return m_size; }
+    inline bool empty() const { return m_size == 0; }
+    inline size_t capacity() const { return m_tags.size(); }
+
+    inline iterator begin() { return iterator(this, 0); }
+    inline iterator end() { return iterator(this, m_tags.size()); }
+    inline const_iterator begin() const { return const_iterator(this, 0); }
+    inline const_iterator end() const { return const_iterator(this, m_tags.size()); }
+
+    inline iterator find(const K& key) { return iterator(this, locate(key)); }
+    inline const_iterator find(const K& key) const { return const_iterator(this, locate(key)); }
+    inline size_t count(const K& key) const { return locate(key) < m_tags.size(); }
+
+    inline V& at(const K& key) {
+        size_t slot = locate(key);
+        if (slot == m_tags.size()) throw std::out_of_range("hash_index::at");
+        return m_entries[slot].second;
+    }
+    inline const V& at(const K& key) const { return const_cast<hash_index*>(this)->at(key); }
+
+    V& operator[](const K& key) {
+        uint64_t h = m_hash(key);
+        bool found;
+        size_t slot = locate(key, h, found);
+        if (found) return m_entries[slot].second;
+        if ((m_size + 1) * 4 > m_tags.size() * 3) {
+            rehash(m_tags.size() << 1);
+            slot = locate(key, h, found);
+        }
+        m_tags[slot] = tag(h);
+        m_entries[slot].first = key;
+        m_entries[slot].second = V();
+        ++m_size;
+        return m_entries[slot].second;
+    }
+
+    size_t erase(const K& key) {
+        size_t slot = locate(key);
+        if (slot == m_tags.size()) return 0;
+        // shift following entries of the probe run back into the hole, where allowed
+        for (size_t next = (slot + 1) & m_mask; m_tags[next]; next = (next + 1) & m_mask) {
+            size_t home = m_hash(m_entries[next].first) & m_mask;
+            if (((next - home) & m_mask) >= ((next - slot) & m_mask)) {
+                m_tags[slot] = m_tags[next];
+                m_entries[slot] = std::move(m_entries[next]);
+                slot = next;
+            }
+        }
+        m_tags[slot] = 0;
+        m_entries[slot] = value_type();
+        --m_size;
+        return 1;
+    }
+
+    /**
+     * Make room for `n` entries without rehashing.
+     */
+    void reserve(size_t n) {
+        size_t capacity = m_tags.size();
+        while (n * 4 > capacity * 3) capacity <<= 1;
+        if (capacity != m_tags.size()) rehash(capacity);
+    }
+
+    void clear() {
+        if (!m_size) return;
+        for (size_t i = 0; i < m_tags.size(); ++i) {
+            if (m_tags[i]) {
+                m_tags[i] = 0;
+                m_entries[i] = value_type();
+            }
+        }
+        m_size = 0;
+    }
+};
+
+/**
+ * A map kept as a vector of (key, value) pairs sorted by key, for keys which are mostly
+ * inserted in increasing order, such as the sids of objects in a cluster. Appending a key
+ * above the current largest is amortized O(1); inserting anywhere else is O(n). Lookups are a
+ * binary search over contiguous memory. clear() keeps the capacity.
+ *
+ * The interface follows std::map for the parts in use, including ordered iteration; pointers
+ * and iterators are invalidated by any insertion or erase.
+ */
+template<typename K, typename V>
+class flat_map {
+public:
+    struct value_type {
+        K first;
+        V second;
+    };
+    typedef typename std::vector<value_type>::iterator iterator;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+private:
+    std::vector<value_type> m_entries;
+
+    static inline bool key_less(const value_type& entry, const K& key) { return entry.first < key; }
+
+    inline size_t locate(const K& key) const {
+        // the common case is a lookup of the most recently appended key
+        size_t sz = m_entries.size();
+        if (sz && !(m_entries[sz - 1].first < key)) {
+            if (!(key < m_entries[sz - 1].first)) return sz - 1;
+            auto it = std::lower_bound(m_entries.begin(), m_entries.end(), key, key_less);
+            if (!(key < it->first)) return it - m_entries.begin();
+        }
+        return sz;
+    }
+
+public:
+    inline size_t size() const { return m_entries.size(); }
+    inline bool empty() const { return m_entries.empty(); }
+
+    inline iterator begin() { return m_entries.begin(); }
+    inline iterator end() { return m_entries.end(); }
+    inline const_iterator begin() const { return m_entries.begin(); }
+    inline const_iterator end() const { return m_entries.end(); }
+
+    inline iterator find(const K& key) { return m_entries.begin() + locate(key); }
+    inline const_iterator find(const K& key) const { return m_entries.begin() + locate(key); }
+    inline size_t count(const K& key) const { return locate(key) < m_entries.size(); }
+
+    inline V& at(const K& key) {
+        size_t i = locate(key);
+        if (i == m_entries.size()) throw std::out_of_range("flat_map::at");
+        return m_entries[i].second;
+    }
+    inline const V& at(const K& key) const { return const_cast<flat_map*>(this)->at(key); }
+
+    V& operator[](const K& key) {
+        if (m_entries.empty() || m_entries.back().first < key) {
+            m_entries.push_back(value_type{key, V()});
+            return m_entries.back().second;
+        }
+        auto it = std::lower_bound(m_entries.begin(), m_entries.end(), key, key_less);
+        if (key < it->first) it = m_entries.insert(it, value_type{key, V()});
+        return it->second;
+    }
+
+    size_t erase(const K& key) {
+        size_t i = locate(key);
+        if (i == m_entries.size()) return 0;
+        m_entries.erase(m_entries.begin() + i);
+        return 1;
+    }
+
+    inline void reserve(size_t n) { m_entries.reserve(n); }
+    inline void clear() noexcept { m_entries.clear(); }
+};
+
+/**
+ * A monotonic allocator handing out memory from large chunks, for objects which mostly die
+ * together (such as the objects of a cluster). Freeing individual allocations only decrements
+ * a live count on their chunk; reset() lets go of all chunks at once, and reuses or frees those
+ * without live allocations. Chunks which still have live allocations when the arena lets go of
+ * them are freed when their last allocation is, so allocations may safely outlive a reset() or
+ * the arena itself.
+ *
+ * Not thread safe: allocations must be freed on the thread using the arena.
+ */
+class arena {
+private:
+    struct chunk {
+        size_t live;        //!< allocations not yet freed
+        size_t used;
+        size_t size;
+        bool retired;       //!< the arena has let go of the chunk, and it is freed with its last allocation
+    };
+    // each allocation is preceded by a pointer to its chunk, padded to keep the alignment
+    static constexpr size_t ALIGN = alignof(std::max_align_t);
+    static constexpr size_t HEADER = (sizeof(chunk) + ALIGN - 1) & ~(ALIGN - 1);
+    static constexpr size_t PREFIX = (sizeof(chunk*) + ALIGN - 1) & ~(ALIGN - 1);
+
+    size_t m_chunk_size;
+    std::vector<chunk*> m_chunks;   //!< chunks owned by the arena; the last one is being allocated from
+
+    static inline uint8_t* data(chunk* c) { return (uint8_t*)c + HEADER; }
+
+    chunk* new_chunk(size_t size) {
+        chunk* c = (chunk*)malloc(HEADER + size);
+        if (!c) throw std::bad_alloc();
+        c->live = c->used = 0;
+        c->size = size;
+        c->retired = false;
+        m_chunks.push_back(c);
+        return c;
+    }
+
+public:
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    explicit arena(size_t chunk_size = CHUNK_SIZE) : m_chunk_size(chunk_size) {}
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena() {
+        reset();
+        for (chunk* c : m_chunks) free(c);
+    }
+
+    void* allocate(size_t n) {
+        size_t need = PREFIX + ((n + ALIGN - 1) & ~(ALIGN - 1));
+        chunk* c = m_chunks.empty() ? nullptr : m_chunks.back();
+        if (!c || c->used + need > c->size) c = new_chunk(need > m_chunk_size ? need : m_chunk_size);
+        uint8_t* p = data(c) + c->used;
+        *(chunk**)p = c;
+        c->used += need;
+        ++c->live;
+        return p + PREFIX;
+    }
+
+    static void deallocate(void* p) {
+        chunk* c = *(chunk**)((uint8_t*)p - PREFIX);
+        if (--c->live == 0) {
+            if (c->retired) free(c); else c->used = 0;
+        }
+    }
+
+    /**
+     * Let go of all chunks. Chunks without live allocations are freed, except one which is kept
+     * for the next allocations; the others are freed along with their last allocation.
+     */
+    void reset() {
+        chunk* spare = nullptr;
+        for (chunk* c : m_chunks) {
+            if (c->live) {
+                c->retired = true;
+            } else if (!spare && c->size == m_chunk_size) {
+                spare = c;
+                c->used = 0;
+            } else {
+                free(c);
+            }
+        }
+        m_chunks.clear();
+        if (spare) m_chunks.push_back(spare);
+    }
+
+    /**
+     * The number of chunks owned by the arena (retired chunks not included).
+     */
+    inline size_t chunk_count() const { return m_chunks.size(); }
+};
+
+/**
+ * Standard allocator adapter for arena, for use with e.g. std::allocate_shared.
+ */
+template<typename T> struct arena_allocator {
+    typedef T value_type;
+    arena* m_arena;
+    explicit arena_allocator(arena* a) noexcept : m_arena(a) {}
+    template<typename U> arena_allocator(const arena_allocator<U>& other) noexcept : m_arena(other.m_arena) {}
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+        return (T*)m_arena->allocate(n * sizeof(T));
+    }
+    void deallocate(T* p, size_t) noexcept { arena::deallocate(p); }
+    template<typename U> bool operator==(const arena_allocator<U>& other) const noexcept { return m_arena == other.m_arena; }
+    template<typename U> bool operator!=(const arena_allocator<U>& other) const noexcept { return m_arena != other.m_arena; }
+};
+
+template<typename T> class intrusive_ptr;
+
+/**
+ * Base class for objects which carry their own reference count, and are handled through
+ * intrusive_ptr rather than std::shared_ptr: there is no separate control block, and copying a
+ * handle is a plain increment. The count is not atomic, so handles to an object must only be
+ * copied and dropped on one thread at a time.
+ */
+class refcounted {
+private:
+    template<typename U> friend class intrusive_ptr;
+    template<typename U, typename... Args> friend intrusive_ptr<U> allocate_intrusive(arena* a, Args&&... args);
+
+    mutable uint32_t m_refs{0};
+    bool m_in_arena{false};     //!< allocated by allocate_intrusive, and returned to its arena when released
+
+    inline void retain() const { ++m_refs; }
+    void release() const {
+        if (--m_refs) return;
+        if (m_in_arena) {
+            void* p = dynamic_cast<void*>(const_cast<refcounted*>(this));
+            this->~refcounted();
+            arena::deallocate(p);
+        } else {
+            delete this;
+        }
+    }
+
+public:
+    refcounted() {}
+    // copies start out unreferenced, and assignment leaves the count alone
+    refcounted(const refcounted&) {}
+    refcounted& operator=(const refcounted&) { return *this; }
+    virtual ~refcounted() {}
+
+    inline uint32_t use_count() const { return m_refs; }
+};
+
+/**
+ * A handle to a refcounted T, mirroring the parts of the std::shared_ptr interface used with
+ * chronology objects.
+ */
+template<typename T> class intrusive_ptr {
+private:
+    template<typename U> friend class intrusive_ptr;
+    T* m_ptr;
+
+public:
+    typedef T element_type;
+
+    intrusive_ptr() noexcept : m_ptr(nullptr) {}
+    intrusive_ptr(std::nullptr_t) noexcept : m_ptr(nullptr) {}
+    explicit intrusive_ptr(T* ptr) : m_ptr(ptr) { if (m_ptr) m_ptr->retain(); }
+    intrusive_ptr(const intrusive_ptr& other) : intrusive_ptr(other.m_ptr) {}
+    intrusive_ptr(intrusive_ptr&& other) noexcept : m_ptr(other.m_ptr) { other.m_ptr = nullptr; }
+    template<typename U> intrusive_ptr(const intrusive_ptr<U>& other) : intrusive_ptr(other.m_ptr) {}
+    ~intrusive_ptr() { if (m_ptr) m_ptr->release(); }
+
+    intrusive_ptr& operator=(intrusive_ptr other) noexcept {
+        std::swap(m_ptr, other.m_ptr);
+        return *this;
+    }
+
+    inline void reset() { intrusive_ptr().swap(*this); }
+    inline void swap(intrusive_ptr& other) noexcept { std::swap(m_ptr, other.m_ptr); }
+
+    inline T* get() const noexcept { return m_ptr; }
+    inline T& operator*() const noexcept { return *m_ptr; }
+    inline T* operator->() const noexcept { return m_ptr; }
+    inline explicit operator bool() const noexcept { return m_ptr != nullptr; }
+    inline long use_count() const noexcept { return m_ptr ? m_ptr->use_count() : 0; }
+
+    inline bool operator==(const intrusive_ptr& other) const noexcept { return m_ptr == other.m_ptr; }
+    inline bool operator!=(const intrusive_ptr& other) const noexcept { return m_ptr != other.m_ptr; }
+    inline bool operator<(const intrusive_ptr& other) const noexcept { return std::less<T*>()(m_ptr, other.m_ptr); }
+    inline bool operator==(std::nullptr_t) const noexcept { return m_ptr == nullptr; }
+    inline bool operator!=(std::nullptr_t) const noexcept { return m_ptr != nullptr; }
+};
+
+template<typename T, typename... Args> intrusive_ptr<T> make_intrusive(Args&&... args) {
+    static_assert(std::is_base_of<refcounted, T>::value, "T must derive from refcounted");
+    return intrusive_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+/**
+ * Construct a refcounted T in memory taken from the given arena; the memory is handed back to
+ * the arena when the last handle goes away.
+ */
+template<typename T, typename... Args> intrusive_ptr<T> allocate_intrusive(arena* a, Args&&... args) {
+    static_assert(std::is_base_of<refcounted, T>::value, "T must derive from refcounted");
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+    void* mem = a->allocate(sizeof(T));
+    T* ptr;
+    try {
+        ptr = new (mem) T(std::forward<Args>(args)...);
+    } catch (...) {
+        arena::deallocate(mem);
+        throw;
+    }
+    static_cast<refcounted*>(ptr)->m_in_arena = true;
+    return intrusive_ptr<T>(ptr);
+}
+
+} // namespace cq
+
+#endif // included_cq_containers_h_
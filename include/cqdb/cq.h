@@ -7,12 +7,16 @@
 #include <map>
 #include <memory>
 #include <ios>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
 
 #include <cstdlib>
 #include <cstdio>
 #include <assert.h>
 
 #include <cqdb/io.h>
+#include <cqdb/containers.h>
 
 #ifdef USE_REFLECTION
 #   define CHRON_DOT(chron) chron->period()
@@ -46,17 +50,109 @@ public:
     }
     inline bool operator!=(const object& other) const { return !operator==(other); }
     bool operator<(const object& other) const { return m_hash < other.m_hash; }
+
+    /**
+     * Read a serialized object far enough to know its hash, leaving the stream positioned after
+     * it. This is all an index-only replay needs; override it for types whose payload can be
+     * skipped without decoding it. While a chronology skips an object, references it decompresses
+     * are read past without being resolved, and known ones come back as H().
+     */
+    virtual void deserialize_index(serializer* stream) { deserialize(stream); }
+};
+
+/**
+ * How chronology holds on to objects of type T: through std::shared_ptr, or, for types deriving
+ * from refcounted (e.g. `class tx : public object<uint256>, public refcounted`), through
+ * intrusive_ptr, which avoids the control block and the atomic reference count updates.
+ */
+template<typename T, bool intrusive = std::is_base_of<refcounted, T>::value> struct handle {
+    typedef std::shared_ptr<T> ptr;
+    template<typename... Args> static inline ptr make(arena* a, Args&&... args) {
+        return a ? std::allocate_shared<T>(arena_allocator<T>(a), std::forward<Args>(args)...) : std::make_shared<T>(std::forward<Args>(args)...);
+    }
+};
+
+template<typename T> struct handle<T, true> {
+    typedef intrusive_ptr<T> ptr;
+    template<typename... Args> static inline ptr make(arena* a, Args&&... args) {
+        return a ? allocate_intrusive<T>(a, std::forward<Args>(args)...) : make_intrusive<T>(std::forward<Args>(args)...);
+    }
 };
 
-static const uint8_t HEADER_VERSION = 1;
+/**
+ * Version 2: segment maps are bitpacked.
+ * Version 3: known references in reference sets are sorted and written as bitpacked gaps.
+ * Version 4: chronology references to known objects may address objects in earlier clusters.
+ * Version 5: headers have a flags byte, for the cluster whose file begins with the header.
+ * Version 6: headers record the time at the beginning of segments (see chronology).
+ * Version 7: headers have a sparse time index (see chronology).
+ * Version 8: the forward index of the cluster being written is an append-only log until the
+ *            cluster is closed (see header::write_log()).
+ */
+static const uint8_t HEADER_VERSION = 8;
+
+/**
+ * Version 1: unversioned; the registry begins with the cluster size.
+ * Version 2: a zero marker and the version precede the cluster size; the cluster list is bitpacked.
+ */
+static const uint8_t REGISTRY_VERSION = 2;
+
+static const uint8_t HEADER_INTERNED = 0x01;   //!< unknown hashes are interned (see db::enable_interning())
+static const uint8_t HEADER_LOG      = 0x02;   //!< the header on disk is a log (see header::write_log()); never set in memory
+
+/**
+ * A sparse index of the times of the events in a cluster. Each mark is an event, with its time,
+ * the time before it (which relative times read from its position are relative to), and its
+ * position and segment. Times are expected not to decrease.
+ */
+struct time_index {
+    struct mark {
+        long time;
+        long clock;
+        id position;
+        id segment;
+    };
+    std::vector<mark> marks;
+
+    void serialize(serializer* stream, uint8_t version) const;
+    void deserialize(serializer* stream, uint8_t version);
+
+    /**
+     * The last mark of an event before `time`, or the first mark if there is none.
+     */
+    const mark* find(long time) const {
+        if (marks.empty()) return nullptr;
+        auto it = std::lower_bound(marks.begin(), marks.end(), time, [](const mark& m, long t) { return m.time < t; });
+        return it == marks.begin() ? &marks[0] : &*(it - 1);
+    }
+};
 
 class header : public serializable {
 private:
     uint8_t m_version;                  //!< CQ version byte
+    uint8_t m_flags;                    //!< HEADER_* flags (version 5+)
     /**
      * A map of segment ID : file position, where the segment ID in bitcoin's case refers to the block height.
      */
     incmap m_segments;
+    /**
+     * A map of segment ID : time at the start of the segment, for segments begun by a chronology (version 6+).
+     */
+    incmap m_segment_times;
+    time_index m_times;                 //!< version 7+
+    /**
+     * While logging (see write_log()), the records of the changes made since the log was last
+     * written to, and the number of records in the log and where it ends.
+     */
+    bool m_logging{false};
+    chv_stream m_pending;
+    uint32_t m_pending_count{0};
+    uint32_t m_log_count{0};
+    long m_log_end{0};
+    void log_segment(id segment, id position);
+    void log_segment_time(id segment, long time);
+    void log_time(const time_index::mark& m);
+    void read_log(serializer* stream);
 public:
     id m_cluster;
 
@@ -68,17 +164,44 @@ public:
 
     void adopt(const header& other) {
         assert(m_version == other.m_version);
+        m_flags = other.m_flags;
         m_segments = other.m_segments;
+        m_segment_times = other.m_segment_times;
+        m_times = other.m_times;
         m_cluster = other.m_cluster;
     }
 
     void mark_segment(id segment, id position);
+    const incmap& get_segments() const { return m_segments; }
     id get_segment_position(id segment) const;
     bool has_segment(id segment) const;
     id get_first_segment() const;
     id get_last_segment() const;
     size_t get_segment_count() const;
+    void mark_segment_time(id segment, long time);
+    bool has_segment_time(id segment) const;
+    long get_segment_time(id segment) const;
+    void mark_time(long time, long clock, id position, id segment) {
+        m_times.marks.push_back(time_index::mark{time, clock, position, segment});
+        if (m_logging) log_time(m_times.marks.back());
+    }
+    const time_index& get_time_index() const { return m_times; }
     uint8_t get_version() const { return m_version; }
+    uint8_t get_flags() const { return m_flags; }
+
+    /**
+     * Write the header as a log (version 8+): the usual prefix with the HEADER_LOG flag, a uint32
+     * record count, and one record per segment, segment time and time mark. From then on, changes
+     * are recorded, and append_log() appends them and updates the count, so that keeping the
+     * header up to date on disk costs as much as the changes rather than the whole header. The
+     * header must be at the start of `stream`. A log is read like any other header.
+     */
+    void write_log(serializer* stream);
+    bool append_log(serializer* stream); //!< returns false if there was nothing to append
+    void end_log();                      //!< stop recording changes
+    bool logging() const { return m_logging; }
+
+    void set_flags(uint8_t flags) { m_flags = m_version >= 5 ? flags : 0; }
     std::string to_string() const {
         std::string s = "<cluster=" + std::to_string(m_cluster) + ">(\n";
         char v[256];
@@ -105,6 +228,35 @@ private:
      * A list of existing clusters in the registry.
      */
     unordered_set m_clusters;
+public:
+    struct segment_location {
+        id cluster;
+        id position;
+    };
+private:
+    /**
+     * Where each segment begins, for all clusters, built from the cluster headers on first use.
+     */
+    flat_map<id, segment_location> m_directory;
+    bool m_directory_built;
+    void build_directory();
+    /**
+     * Recently read headers of clusters that are no longer written to, keyed by the cluster whose
+     * file they are at the start of, so that jumping back and forth does not parse them anew.
+     */
+    struct cached_header {
+        id cluster;
+        header hdr;
+        id data_start;
+        uint64_t stamp;
+    };
+    std::vector<cached_header> m_header_cache;
+    size_t m_header_cache_size;
+    uint64_t m_header_clock;
+    header m_peeked;            //!< see peek_forward_index(), for headers which may not be cached
+    bool sealed(id cluster) { return cluster_next(cluster) != nullid; }
+    const cached_header* find_header(id cluster);
+    void cache_header(id cluster, const header& hdr, id data_start);
 public:
     uint32_t m_cluster_size;
     id m_tip;
@@ -112,16 +264,24 @@ public:
     header m_forward_index;    // this is the worked-on header for the current (unfinished) cluster
     header m_back_index;       // this is the readonly header referencing the previous cluster, if any
     id m_current_cluster;
+    id m_data_start;           // position in the current cluster file where its data begins (after the back index)
+    uint8_t m_header_flags;    // flags given to new headers
 
     registry(registry_delegate* delegate, const std::string& dbpath, const std::string& prefix, uint32_t cluster_size = 1024)
     :   m_dbpath(dbpath)
     ,   m_prefix(prefix)
+    ,   m_directory_built(false)
+    ,   m_header_cache_size(8)
+    ,   m_header_clock(0)
+    ,   m_peeked(HEADER_VERSION, nullid)
     ,   m_cluster_size(cluster_size)
     ,   m_tip(0)
     ,   m_delegate(delegate)
     ,   m_forward_index(HEADER_VERSION, nullid)
     ,   m_back_index(HEADER_VERSION, nullid)
     ,   m_current_cluster(nullid)
+    ,   m_data_start(0)
+    ,   m_header_flags(0)
     {}
 
     prepare_for_serialization();
@@ -135,15 +295,18 @@ public:
         m_forward_index.adopt(other.m_forward_index);
         m_back_index.adopt(other.m_back_index);
         m_current_cluster = other.m_current_cluster;
+        m_directory_built = false;
     }
 
     // cluster delegation
     virtual id cluster_next(id cluster) override;
     virtual id cluster_last(bool open_for_writing) override;
-    virtual std::string cluster_path(id cluster) override;
+    virtual std::string cluster_path(id cluster) override { return cluster_path(cluster, ".cq"); }
+    std::string cluster_path(id cluster, const char* suffix); //!< path of a file of the given cluster, e.g. ".idx" for the sidecar index (see chronology)
     virtual void cluster_will_close(id cluster) override;
     virtual void cluster_opened(id cluster, file* file) override;
     virtual void cluster_write_forward_index(id cluster, file* file) override;
+    virtual void cluster_log_forward_index(id cluster, file* file) override;
     virtual void cluster_read_forward_index(id cluster, file* file) override;
     virtual void cluster_clear_forward_index(id cluster) override;
     virtual void cluster_read_back_index(id cluster, file* file) override;
@@ -151,11 +314,41 @@ public:
     virtual bool cluster_iterate(id cluster, file* file) override { return m_delegate->registry_iterate(file); }
 
     id prepare_cluster_for_segment(id segment);
+
+    /**
+     * Set the number of cluster headers kept around for clusters that have been left (0 disables).
+     */
+    void set_header_cache_size(size_t size);
+
+    /**
+     * Read the forward index of a cluster other than the current one (at the start of the file of
+     * the cluster after it) through the header cache, without opening the cluster. Returns nullptr
+     * if there is no such file. The header is valid until the next header is read.
+     */
+    const header* peek_forward_index(id cluster);
+
+    /**
+     * Mark the beginning of a segment in the current cluster.
+     */
+    void mark_segment(id segment, id position);
+
+    /**
+     * Look up where the given segment begins, without opening its cluster. The first lookup reads
+     * the headers of all clusters, after which the directory is kept up to date by mark_segment().
+     * Returns false for segments which are not known (e.g. begun by another process since).
+     */
+    bool find_segment(id segment, segment_location& location);
     inline bool operator==(const registry& other) const { return m_cluster_size == other.m_cluster_size && m_clusters == other.m_clusters && m_tip == other.m_tip; }
     inline const unordered_set& get_clusters() const { return m_clusters; }
 };
 
-template<typename H> class db : public registry_delegate {
+/**
+ * The db is templated on the file type F of its cluster files. With the default cq::file,
+ * all stream operations are virtual calls; instantiating with one of the final file types
+ * (e.g. cq::posix_file) lets the compiler resolve and inline the hot path (event headers,
+ * varints, references) entirely. The backend is then forced to match F.
+ */
+template<typename H, typename F = file> class db : public registry_delegate {
 protected:
     const std::string m_dbpath;
     const std::string m_prefix;
@@ -166,16 +359,63 @@ protected:
     void close();
     bool m_readonly;
 
+    // reusable buffers for reference sets, so that writing and reading them does not allocate
+    std::vector<id> m_scratch_sids;             //!< known sids (or their deltas)
+    std::vector<const H*> m_scratch_hashes;     //!< unknown hashes
+
+    // interning of unknown hashes in the current cluster; see enable_interning()
+    bool m_interning;
+    hash_index<H, id> m_interned;               //!< hash -> position of its first occurrence (when writing)
+    hash_index<id, H> m_interned_at;            //!< position -> hash, for the occurrences seen (when reading)
+
+    /**
+     * Write or read an unknown hash, interned if the current cluster interns hashes.
+     */
+    void write_unknown(const H& hash);
+    void read_unknown(H& hash);
+
+    /**
+     * Write an unordered set of references to the known objects in m_scratch_sids and the
+     * unknown objects in m_scratch_hashes. m_scratch_sids is clobbered.
+     */
+    void refer_scratch();
+
+    /**
+     * Read the header and the known references of a reference set into `known_out`, in the
+     * order they are on disk, returning the number of unknown references that follow.
+     */
+    id derefer_known(std::vector<id>& known_out);
+
 public:
-    file* m_file;
+    F* m_file;
+    file_cache m_files;     //!< readonly files of clusters that have been left (outlives m_ic)
     registry m_reg;
     indexed_cluster m_ic;
 
     // struction
-    db(const std::string& dbpath, const std::string& prefix, uint32_t cluster_size = 1024, bool readonly = false);
+    db(const std::string& dbpath, const std::string& prefix, uint32_t cluster_size = 1024, bool readonly = false, uint8_t backend = stdio_backend);
     virtual ~db();
     void load();
 
+    /**
+     * Intern unknown hashes: the first time an unknown hash is written in a cluster, it is
+     * written in full (prefixed by a zero byte), after which it is written as a back-reference
+     * (the distance to the first one). The setting goes into the headers of new clusters, and
+     * applies to the current cluster as well if nothing has been written to it yet. Interning
+     * requires version 5 headers.
+     */
+    void enable_interning();
+
+    /**
+     * Set how many files and headers of clusters that are no longer written to are kept around
+     * after being left, to make jumping back and forth between them cheap. Each cached file holds
+     * a file descriptor (or mapping). 0 disables the cache.
+     */
+    void set_cache_size(size_t size) {
+        m_files.set_budget(size);
+        m_reg.set_header_cache_size(size);
+    }
+
     // registry delegate
     virtual void registry_closing_cluster(id cluster) override;
     virtual void registry_opened_cluster(id cluster, file* file) override;
@@ -194,6 +434,8 @@ public:
     void refer(object<H>** ts, size_t sz);     // writes an unordered set of references to sz number of objects
     void derefer(std::set<id>& known        // reads an unordered set of known/unknown references from disk
                , std::set<H>& unknown);
+    void derefer(std::vector<id>& known     // as above, into reusable buffers, in the order they are on disk
+               , std::vector<H>& unknown);
 
     inline const registry& get_registry() const { return m_reg; }
     inline const id& get_cluster() const { return m_ic.m_cluster; }
@@ -220,14 +462,14 @@ public:
      */
     inline void rewind() { goto_segment(*m_reg.get_clusters().m.begin()); }
 
-    void flush();
+    virtual void flush();
 };
 
 inline uint8_t time_rel_value(uint8_t cmd) { return cmd >> 6; }
 inline uint8_t time_rel_bits(int64_t time) { return ((time < 3 ? time : 3) << 6); }
 
 #define _read_time(H, t, current_time, timerel) \
-    t = current_time + timerel + (timerel > 2 ? varint::load(m_file) : 0)
+    t = current_time + timerel + (timerel > 2 ? varint::decode(*m_file) : 0)
 
 #define read_cmd_time(H, u8, cmd, known, timerel, time, current_time) do { \
         u8 = m_file->get_uint8(); \
@@ -240,7 +482,7 @@ inline uint8_t time_rel_bits(int64_t time) { return ((time < 3 ? time : 3) << 6)
 #define _write_time(H, rel, current_time, write_time) do { \
         if (time_rel_value(rel) > 2) { \
             uint64_t tfull = uint64_t(write_time - time_rel_value(rel) - current_time); \
-            varint(tfull).serialize(m_file); \
+            varint::encode(*m_file, tfull); \
             current_time = write_time; \
         } else { \
             current_time += time_rel_value(rel);\
@@ -281,18 +523,247 @@ inline uint8_t time_rel_bits(int64_t time) { return ((time < 3 ? time : 3) << 6)
  *      -'-;                    [cmd:LEAVE; known]  -> ref = pop_reference();               m_references.at(ref) == bar
  *      -'-;                    [cmd:GRADUATE]      -> pop_references(known, unknown);      known == [foo, bar]
  */
-template<typename H, typename T>
-class chronology : public db<H>, public compressor<H> {
+template<typename H, typename T, typename F = file>
+class chronology : public db<H, F>, public compressor<H> {
 protected:
 public:
-    using db<H>::derefer;
-    using db<H>::refer;
-    using db<H>::m_reg;
-    using db<H>::m_file;
-    using db<H>::m_ic;
+    using db<H, F>::derefer;
+    using db<H, F>::refer;
+    using db<H, F>::m_reg;
+    using db<H, F>::m_file;
+    using db<H, F>::m_ic;
+    using db<H, F>::m_files;
+    using db<H, F>::m_scratch_sids;
+    using db<H, F>::m_scratch_hashes;
+    typedef typename handle<T>::ptr ptr;   //!< std::shared_ptr<T>, or intrusive_ptr<T> for refcounted types
     long m_current_time;
-    std::map<id, std::shared_ptr<T>> m_dictionary;
-    std::map<H, id> m_references;
+    flat_map<id, ptr> m_dictionary;     //!< sid -> object, for objects stored in the current cluster
+    std::unique_ptr<arena> m_arena;                     //!< if set, objects loaded from disk are allocated from here
+
+    /**
+     * Allocate the objects loaded from disk (by pop_object) from a per-cluster arena, which is
+     * reset when the cluster is closed. Objects still referenced outside of the chronology at
+     * that point stay valid; their memory is released with the last of them.
+     */
+    void enable_arena(size_t chunk_size = arena::CHUNK_SIZE) {
+        m_arena.reset(new arena(chunk_size));
+    }
+    hash_index<H, id> m_references;     //!< hash -> sid of known objects (specialize cq::hasher<H> for random hashes)
+    bool m_index_only_replay{false};    //!< see replaying_index_only()
+    bool m_sidecar_index{false};        //!< see enable_sidecar_index()
+    long m_sidecar_size{-1};            //!< size of the cluster when its sidecar index was last written or read
+    bool m_checkpoints{false};          //!< see enable_checkpoints()
+    id m_checkpoint_interval{0};
+    id m_time_index_interval{TIME_INDEX_INTERVAL}; //!< see set_time_index_interval()
+    long m_next_time_mark{0};           //!< position from which the next event is added to the time index
+
+    static constexpr id TIME_INDEX_INTERVAL = 1 << 16;
+
+    /**
+     * Add an event to the time index of the cluster (see time_index) whenever at least `bytes`
+     * were written since the last one; the first event of a cluster is always added. Zero turns
+     * the time index off.
+     */
+    inline void set_time_index_interval(id bytes) { m_time_index_interval = bytes; }
+
+    /**
+     * Objects from earlier clusters, addressed by the cluster and their sid in it.
+     */
+    struct address {
+        id cluster;
+        id sid;
+        inline bool operator==(const address& other) const { return cluster == other.cluster && sid == other.sid; }
+    };
+    struct carried {
+        H hash;
+        ptr object;
+        uint64_t stamp;     //!< when the object was last seen, for evicting the oldest ones
+    };
+    size_t m_carry_capacity{0};                 //!< see enable_carry_over()
+    uint64_t m_carry_stamp{0};
+    hash_index<address, carried> m_carried;     //!< the carry-over table
+    hash_index<H, address> m_carried_hashes;    //!< the same, by hash
+    flat_map<id, address> m_imported;           //!< sid in the current cluster -> original address, of objects imported from earlier clusters
+    std::set<id> m_uncarried;                   //!< sids of objects in the current cluster which compress references, and are not carried over
+    bool m_compressor_used{false};              //!< set whenever the chronology compresses or decompresses references
+
+    /**
+     * When a cluster is closed, the chronology normally forgets about all of its objects, and
+     * objects seen again in the next cluster have to be stored again, or referred to by hash.
+     * With carry-over enabled, up to `capacity` of the most recently seen objects are kept in a
+     * table when closing a cluster. A writer refers to such an object, the first time it is seen
+     * in a later cluster, by its address (cluster delta and sid); from there on it is known in
+     * the new cluster as any object stored in it. A reader resolves the address from its own
+     * table, or, if it did not see the object (e.g. after goto_segment()), by reading the object
+     * from the earlier cluster. Only single object references are carried over; reference sets
+     * refer to such objects by hash. Objects which compress references through the chronology
+     * are not carried over, as those references only resolve within their own cluster.
+     */
+    inline void enable_carry_over(size_t capacity) { m_carry_capacity = capacity; }
+
+    void carry(const address& a, const ptr& object) {
+        auto it = m_carried_hashes.find(object->m_hash);
+        if (it != m_carried_hashes.end() && !(it->second == a)) {
+            // stored again since; the newer copy takes over
+            m_carried.erase(it->second);
+        }
+        m_carried_hashes[object->m_hash] = a;
+        carried& c = m_carried[a];
+        c.hash = object->m_hash;
+        c.object = object;
+        c.stamp = ++m_carry_stamp;
+    }
+
+    /**
+     * Carry the objects of the cluster being closed over into the table, and evict the oldest
+     * entries beyond its capacity.
+     */
+    void carry_over(id cluster) {
+        if (!m_carry_capacity) return;
+        for (const auto& kv : m_dictionary) {
+            // objects imported into the cluster are carried over with their original address
+            auto imported = m_imported.find(kv.first);
+            if (imported != m_imported.end()) {
+                carry(imported->second, kv.second);
+            } else if (!m_uncarried.count(kv.first)) {
+                carry(address{cluster, kv.first}, kv.second);
+            }
+        }
+        size_t count = m_carried.size();
+        if (count <= m_carry_capacity) return;
+        std::vector<uint64_t> stamps;
+        stamps.reserve(count);
+        for (const auto& kv : m_carried) stamps.push_back(kv.second.stamp);
+        std::nth_element(stamps.begin(), stamps.begin() + (count - m_carry_capacity), stamps.end());
+        uint64_t oldest_kept = stamps[count - m_carry_capacity];
+        std::vector<address> evicted;
+        for (const auto& kv : m_carried) if (kv.second.stamp < oldest_kept) evicted.push_back(kv.first);
+        for (const address& a : evicted) {
+            m_carried_hashes.erase(m_carried.at(a).hash);
+            m_carried.erase(a);
+        }
+    }
+
+    /**
+     * Make an object from an earlier cluster known in the current one, at `pos`.
+     */
+    void import(const address& a, const ptr& object, id pos) {
+        object->m_sid = pos;
+        m_dictionary[pos] = object;
+        m_references[object->m_hash] = pos;
+        m_imported[pos] = a;
+        if (m_carry_capacity) carry(a, object);
+    }
+    std::unique_ptr<T> m_skipped;       //!< reused by skip_object()
+    bool m_skipping{false};             //!< in skip_object(), where decompress() does not resolve references
+
+    /**
+     * When resuming a cluster for writing, only m_references is needed to carry on appending
+     * events. With index-only replay enabled, delegates may use skip_object() and the other
+     * skip_*() methods instead of their pop_*() counterparts while replaying_index_only() is
+     * true, so that resuming does not construct an object per stored object. Objects skipped
+     * this way are not in the dictionary, so tretch() does not find them.
+     */
+    inline void enable_index_only_replay(bool enable = true) { m_index_only_replay = enable; }
+
+    /**
+     * Keep a sidecar index next to the cluster being written, with the hash -> sid index sorted
+     * by hash, along with the size of the cluster, the current time, and the original addresses
+     * of the objects imported from earlier clusters. It is rewritten when
+     * the cluster is flushed or closed, if the cluster has grown since. Resuming the cluster for writing then loads the sidecar
+     * instead of replaying the cluster, unless the cluster has changed size since it was written.
+     * As with index-only replay, the objects are not brought back into the dictionary.
+     */
+    inline void enable_sidecar_index(bool enable = true) { m_sidecar_index = enable; }
+
+    void write_sidecar_index() {
+        if (!m_file || m_file->readonly() || m_file->tell() == m_sidecar_size) return;
+        std::vector<std::pair<H, id>> entries;
+        entries.reserve(m_references.size());
+        for (const auto& kv : m_references) entries.emplace_back(kv.first, kv.second);
+        std::sort(entries.begin(), entries.end(), [](const std::pair<H, id>& a, const std::pair<H, id>& b) { return a.first < b.first; });
+        file sidecar(m_reg.cluster_path(m_reg.m_current_cluster, ".idx"), false, true);
+        uint8_t version = 2;
+        uint64_t size = m_file->tell();
+        int64_t time = m_current_time;
+        uint64_t count = entries.size();
+        serialize(sidecar, version);
+        serialize(sidecar, size);
+        serialize(sidecar, time);
+        serialize(sidecar, count);
+        // fixed size entries, so that the file can be binary searched in place
+        for (const auto& e : entries) {
+            uint64_t sid = e.second;
+            serialize(sidecar, e.first);
+            serialize(sidecar, sid);
+        }
+        count = m_imported.size();
+        serialize(sidecar, count);
+        for (const auto& kv : m_imported) {
+            uint64_t u64 = kv.first;
+            serialize(sidecar, u64);
+            u64 = kv.second.cluster;
+            serialize(sidecar, u64);
+            u64 = kv.second.sid;
+            serialize(sidecar, u64);
+        }
+        m_sidecar_size = size;
+    }
+
+    /**
+     * Load the sidecar index of the cluster being resumed for writing, if there is one matching
+     * it, and move to the end of the cluster. Returns false if the cluster must be replayed.
+     */
+    bool read_sidecar_index() {
+        std::string path = m_reg.cluster_path(m_reg.m_current_cluster, ".idx");
+        if (!file::accessible(path)) return false;
+        long pos = m_file->tell();
+        m_file->seek(0, SEEK_END);
+        uint64_t data_size = m_file->tell();
+        try {
+            file sidecar(path, true);
+            uint8_t version;
+            uint64_t size, count, sid, pos, cluster;
+            int64_t time;
+            deserialize(sidecar, version);
+            deserialize(sidecar, size);
+            if (version == 2 && size == data_size) {
+                deserialize(sidecar, time);
+                deserialize(sidecar, count);
+                m_references.clear();
+                m_references.reserve(count);
+                H hash;
+                for (uint64_t i = 0; i < count; ++i) {
+                    deserialize(sidecar, hash);
+                    deserialize(sidecar, sid);
+                    m_references[hash] = sid;
+                }
+                deserialize(sidecar, count);
+                m_imported.clear();
+                for (uint64_t i = 0; i < count; ++i) {
+                    deserialize(sidecar, pos);
+                    deserialize(sidecar, cluster);
+                    deserialize(sidecar, sid);
+                    m_imported[pos] = address{cluster, sid};
+                }
+                m_current_time = time;
+                m_sidecar_size = size;
+                return true;
+            }
+        } catch (const io_error& err) {
+            // a partially written sidecar; replay instead
+            m_references.clear();
+            m_imported.clear();
+        }
+        m_file->seek(pos, SEEK_SET);
+        return false;
+    }
+
+    /**
+     * True while registry_iterate() is bringing a writable cluster up to date (the file is then
+     * not readonly) with index-only replay enabled.
+     */
+    inline bool replaying_index_only() const { return m_index_only_replay && m_file && !m_file->readonly(); }
 
 #ifdef USE_REFLECTION
     std::shared_ptr<chronology> m_reflection; // debug tool used to assert that serialized data deserializes to itself
@@ -329,14 +800,9 @@ public:
                 ++kv1; ++kv2;
             }
         }
-        {
-            auto kv1 = m_references.begin();        auto kv2 = other.m_references.begin();
-            const auto& end1 = m_references.end();  const auto& end2 = other.m_references.end();
-            while (kv1 != end1 && kv2 != end2) {
-                if (kv1->first != kv2->first) return false;
-                if (kv1->second != kv2->second) return false;
-                ++kv1; ++kv2;
-            }
+        for (const auto& kv : m_references) {
+            auto it = other.m_references.find(kv.first);
+            if (it == other.m_references.end() || it->second != kv.second) return false;
         }
         return true;
     }
@@ -359,47 +825,63 @@ public:
 
     virtual void compress(serializer* stm, const std::vector<H>& references) override {
         assert(stm == m_file);
+        m_compressor_used = true;
         // generate known bit field
         size_t refs = references.size();
         bitfield bf(refs);
-        for (size_t i = 0; i < refs; ++i) if (m_references.count(references[i])) bf.set(i); else bf.unset(i);
+        m_scratch_sids.resize(refs);
+        for (size_t i = 0; i < refs; ++i) {
+            auto it = m_references.find(references[i]);
+            if (it != m_references.end()) {
+                bf.set(i);
+                m_scratch_sids[i] = it->second;
+            } else {
+                bf.unset(i);
+            }
+        }
         // length of vector as varint
-        *m_file << varint(refs);
+        varint::encode(*m_file, refs);
         // write bitfield
-        *m_file << bf;
+        bf.encode(*m_file);
         for (size_t i = 0; i < refs; ++i) {
             if (bf[i]) {
-                *m_file << varint(m_file->tell() - m_references.at(references[i]));
+                varint::encode(*m_file, m_file->tell() - m_scratch_sids[i]);
             } else {
-                serialize(*m_file, references[i]);
+                db<H, F>::write_unknown(references[i]);
             }
         }
     }
 
     virtual void compress(serializer* stm, const H& reference) override {
         assert(stm == m_file);
-        uint8_t known = m_references.count(reference);
-        *m_file << known;
+        m_compressor_used = true;
+        auto it = m_references.find(reference);
+        uint8_t known = it != m_references.end();
+        serialize(*m_file, known);
         if (known) {
-            *m_file << varint(m_file->tell() - m_references.at(reference));
+            varint::encode(*m_file, m_file->tell() - it->second);
         } else {
-            serialize(*m_file, reference);
+            db<H, F>::write_unknown(reference);
         }
     }
 
     virtual void decompress(serializer* stm, std::vector<H>& references) override {
         assert(stm == m_file);
+        m_compressor_used = true;
         // length of vector as varint
-        size_t refs = varint::load(m_file);
+        size_t refs = varint::decode(*m_file);
         // fetch known bit field
         bitfield bf(refs);
-        *m_file >> bf;
+        bf.decode(*m_file);
         H u;
         for (size_t i = 0; i < refs; ++i) {
-            if (bf[i]) {
-                references.push_back(m_dictionary.at(m_file->tell() - varint::load(m_file))->m_hash);
+            if (bf[i] && m_skipping) {
+                varint::decode(*m_file);
+                references.push_back(H());
+            } else if (bf[i]) {
+                references.push_back(m_dictionary.at(m_file->tell() - varint::decode(*m_file))->m_hash);
             } else {
-                deserialize(*stm, u);
+                db<H, F>::read_unknown(u);
                 references.push_back(u);
             }
         }
@@ -407,78 +889,148 @@ public:
 
     virtual void decompress(serializer* stm, H& reference) override {
         assert(stm == m_file);
+        m_compressor_used = true;
         uint8_t known;
-        *m_file >> known;
+        deserialize(*m_file, known);
+        if (known && m_skipping) {
+            varint::decode(*m_file);
+            reference = H();
+        } else if (known) {
+            reference = m_dictionary.at(m_file->tell() - varint::decode(*m_file))->m_hash;
+        } else {
+            db<H, F>::read_unknown(reference);
+        }
+    }
+
+    /**
+     * Skip past a compressed reference or vector of references, without resolving the known
+     * ones (which, unlike decompress, does not need their objects in the dictionary).
+     */
+    void skip_compressed_reference() {
+        uint8_t known;
+        deserialize(*m_file, known);
         if (known) {
-            reference = m_dictionary.at(m_file->tell() - varint::load(m_file))->m_hash;
+            varint::decode(*m_file);
         } else {
-            deserialize(*m_file, reference);
+            H u;
+            db<H, F>::read_unknown(u);
         }
     }
 
-    inline std::shared_ptr<T> tretch(const H& hash) { return m_references.count(hash) ? m_dictionary.at(m_references.at(hash)) : nullptr; }
+    void skip_compressed_references() {
+        size_t refs = varint::decode(*m_file);
+        bitfield bf(refs);
+        bf.decode(*m_file);
+        H u;
+        for (size_t i = 0; i < refs; ++i) {
+            if (bf[i]) {
+                varint::decode(*m_file);
+            } else {
+                db<H, F>::read_unknown(u);
+            }
+        }
+    }
+
+    inline ptr tretch(const H& hash) {
+        auto it = m_references.find(hash);
+        if (it == m_references.end()) return ptr();
+        auto ob = m_dictionary.find(it->second);
+        return ob != m_dictionary.end() ? ob->second : ptr();
+    }
 
-    chronology(const std::string& dbpath, const std::string& prefix, uint32_t cluster_size = 1024, bool readonly = false)
+    chronology(const std::string& dbpath, const std::string& prefix, uint32_t cluster_size = 1024, bool readonly = false, uint8_t backend = stdio_backend)
     :   m_current_time(0)
 #ifdef USE_REFLECTION
     ,   m_reflection(nullptr)
 #endif // USE_REFLECTION
-    ,   db<H>(dbpath, prefix, cluster_size, readonly)
+    ,   db<H, F>(dbpath, prefix, cluster_size, readonly, backend)
     {}
 
+    ~chronology() override {
+        // the db closes the cluster after we are gone, so the sidecar is written here
+        if (m_sidecar_index) write_sidecar_index();
+    }
+
+    void flush() override {
+        db<H, F>::flush();
+        if (m_sidecar_index) write_sidecar_index();
+    }
+
     //////////////////////////////////////////////////////////////////////////////////////
     // Writing
     //
 
-    void push_event(long timestamp, uint8_t cmd, std::shared_ptr<T> subject = nullptr, bool refer_only = true) {
+    void push_event(long timestamp, uint8_t cmd, const ptr& subject = nullptr, bool refer_only = true) {
         if (!m_file) begin_segment(0);
         assert(timestamp >= m_current_time);
-        bool known = subject.get() && m_references.count(subject->m_hash);
-        if (known && subject->m_sid == 0) subject->m_sid = m_references[subject->m_hash];
+        if (m_time_index_interval && m_file->tell() >= m_next_time_mark) {
+            m_reg.m_forward_index.mark_time(timestamp, m_current_time, m_file->tell(), m_reg.m_tip);
+            m_next_time_mark = m_file->tell() + (long)m_time_index_interval;
+        }
+        bool known = false;
+        auto origin = m_carried_hashes.end();
+        if (subject.get()) {
+            auto it = m_references.find(subject->m_hash);
+            known = it != m_references.end();
+            if (known && subject->m_sid == 0) subject->m_sid = it->second;
+            if (!known && m_carry_capacity && m_reg.m_back_index.get_version() >= 4) {
+                origin = m_carried_hashes.find(subject->m_hash);
+                known = origin != m_carried_hashes.end();
+            }
+        }
         uint8_t header_byte = cmd | (known << 5) | time_rel_bits(timestamp - m_current_time);
-        *m_file << header_byte;
+        serialize(*m_file, header_byte);
         _write_time(H, header_byte, m_current_time, timestamp); // this updates m_current_time
         if (subject.get()) {
-            if (known) {
+            if (origin != m_carried_hashes.end()) {
+                // a zero delta (which never refers to an object in the cluster) is followed by the address
+                address a = origin->second;
+                id pos = m_file->tell();
+                varint::encode(*m_file, 0);
+                varint::encode(*m_file, m_reg.m_current_cluster - a.cluster);
+                varint::encode(*m_file, a.sid);
+                import(a, subject, pos);
+            } else if (known) {
                 refer(subject.get());
             } else if (refer_only) {
                 refer(subject->m_hash);
             } else {
-                id obid = db<H>::store(subject.get());
+                m_compressor_used = false;
+                id obid = db<H, F>::store(subject.get());
+                if (m_compressor_used) m_uncarried.insert(obid);
                 m_dictionary[obid] = subject;
                 m_references[subject->m_hash] = obid;
             }
         }
     }
 
-    void push_event(long timestamp, uint8_t cmd, const std::set<std::shared_ptr<T>>& subjects) {
+    void push_event(long timestamp, uint8_t cmd, const std::set<ptr>& subjects) {
         push_event(timestamp, cmd);
-        object<H>* ts[subjects.size()];
-        size_t i = 0;
+        m_scratch_sids.clear();
+        m_scratch_hashes.clear();
         for (auto& tp : subjects) {
-            ts[i++] = tp.get();
+            if (tp->m_sid) {
+                m_scratch_sids.push_back(tp->m_sid);
+            } else {
+                m_scratch_hashes.push_back(&tp->m_hash);
+            }
         }
-        refer(ts, i);
+        db<H, F>::refer_scratch();
     }
 
     void push_event(long timestamp, uint8_t cmd, const std::set<H>& subject_hashes) {
         push_event(timestamp, cmd);
-        std::set<std::shared_ptr<T>> pool;
-        object<H>* ts[subject_hashes.size()];
-        size_t i = 0;
+        m_scratch_sids.clear();
+        m_scratch_hashes.clear();
         for (auto& hash : subject_hashes) {
-            if (m_references.count(hash)) {
-                // known
-                ts[i] = m_dictionary.at(m_references.at(hash)).get();
+            auto it = m_references.find(hash);
+            if (it != m_references.end()) {
+                m_scratch_sids.push_back(it->second);
             } else {
-                // unknown
-                auto ob = std::make_shared<T>(this, hash);
-                pool.insert(ob);
-                ts[i] = ob.get();
+                m_scratch_hashes.push_back(&hash);
             }
-            ++i;
         }
-        refer(ts, i);
+        db<H, F>::refer_scratch();
     }
 
     //////////////////////////////////////////////////////////////////////////////////////
@@ -492,15 +1044,20 @@ public:
             if (next_cluster == nullid) return false;
             m_ic.open(next_cluster, true);
         }
+        // running out of data is the normal way for this to end, so we use the non-throwing
+        // read path; a partially written event is rewound and reported as no event
         auto pos = m_ic.m_file->tell();
-        try {
-            read_cmd_time(H, u8, cmd, known, timerel, time, m_current_time);
-            if (peeking) m_ic.m_file->seek(pos, SEEK_SET);
-        } catch (io_error) {
-            return false;
-        } catch (std::ios_base::failure& f) {
+        id trel = 0;
+        if (!m_file->try_get_uint8(u8)) return false;
+        timerel = time_rel_value(u8);
+        if (timerel > 2 && !varint::try_load(m_file, trel)) {
+            m_ic.m_file->seek(pos, SEEK_SET);
             return false;
         }
+        cmd = (u8 & 0x1f);
+        known = 0 != (u8 & 0x20);
+        time = m_current_time + timerel + trel;
+        if (peeking) m_ic.m_file->seek(pos, SEEK_SET);
         return true;
     }
 
@@ -514,16 +1071,199 @@ public:
         return _pop_next(cmd, known, m_current_time);
     }
 
-    std::shared_ptr<T> pop_object() {
-        std::shared_ptr<T> object = std::make_shared<T>(this);
-        db<H>::load(object.get());
+    ptr pop_object() {
+        ptr object = handle<T>::make(m_arena.get(), this);
+        m_compressor_used = false;
+        db<H, F>::load(object.get());
         id obid = object->m_sid;
+        if (m_compressor_used) m_uncarried.insert(obid);
         m_dictionary[obid] = object;
         m_references[object->m_hash] = obid;
-        return m_dictionary.at(obid);
+        return object;
+    }
+
+    /**
+     * Read past an object written by push_event(.., refer_only = false), recording its sid in
+     * the reference index without adding it to the dictionary. See enable_index_only_replay().
+     */
+    id skip_object() {
+        if (!m_skipped) m_skipped.reset(new T(this));
+        id obid = m_file->tell();
+        m_skipping = true;
+        try {
+            m_skipped->deserialize_index(m_file);
+        } catch (...) {
+            m_skipping = false;
+            throw;
+        }
+        m_skipping = false;
+        m_references[m_skipped->m_hash] = obid;
+        return obid;
+    }
+
+    id pop_reference() {
+        id pos = m_file->tell();
+        id delta = varint::decode(*m_file);
+        return delta ? pos - delta : pop_carried_reference(pos);
+    }
+
+    /**
+     * Resolve a reference to an object in an earlier cluster (see enable_carry_over()), and
+     * return the sid it is known by in the current cluster.
+     */
+    id pop_carried_reference(id pos) {
+        address a;
+        a.cluster = m_reg.m_current_cluster - varint::decode(*m_file);
+        a.sid = varint::decode(*m_file);
+        import(a, carried_object(a), pos);
+        return pos;
+    }
+
+    /**
+     * Write a checkpoint of the dictionary at the start of every segment divisible by `interval`,
+     * into a file next to the cluster (with the suffix ".chk"). Readers enabling
+     * checkpoints (with any interval) have goto_segment() restore the dictionary from the last
+     * checkpoint at or before the segment, and replay (through registry_iterate()) only the events
+     * from there on, so that references in the events that follow resolve.
+     *
+     * Checkpoints hold the sids of the objects only; the objects are fetched from the cluster
+     * (or, for objects from earlier clusters, from theirs) when the checkpoint is loaded. They are
+     * made from the reference index rather than the dictionary, which is incomplete after resuming
+     * with index-only replay or a sidecar index.
+     */
+    inline void enable_checkpoints(id interval) { m_checkpoints = true; m_checkpoint_interval = interval; }
+
+    void write_checkpoint(id segment) {
+        chv_stream body;
+        uint64_t u64 = segment;
+        serialize(body, u64);
+        u64 = m_file->tell();
+        serialize(body, u64);
+        int64_t time = m_current_time;
+        serialize(body, time);
+        std::vector<id> sids;
+        sids.reserve(m_references.size());
+        for (const auto& kv : m_references) sids.push_back(kv.second);
+        std::sort(sids.begin(), sids.end());
+        varint::encode(body, (id)sids.size());
+        id last = 0;
+        for (id sid : sids) {
+            // sids as gaps, and for imported objects their original address
+            auto imported = m_imported.find(sid);
+            varint::encode(body, sid - last);
+            last = sid;
+            if (imported == m_imported.end()) {
+                varint::encode(body, (id)0);
+            } else {
+                varint::encode(body, m_reg.m_current_cluster - imported->second.cluster);
+                varint::encode(body, imported->second.sid);
+            }
+        }
+        // the checkpoint must not get to disk before the data it points into
+        m_file->flush();
+        file checkpoints(m_reg.cluster_path(m_reg.m_current_cluster, ".chk"), false);
+        checkpoints.seek(0, SEEK_END);
+        uint32_t size = body.get_chv().size();
+        serialize(checkpoints, size);
+        checkpoints.write(body.get_chv().data(), size);
+    }
+
+    /**
+     * Restore the dictionary from the last checkpoint at or before `segment` in the current
+     * cluster, and move to its position. Returns false if there is no such checkpoint.
+     * Checkpoints pointing past the end of the cluster (e.g. written ahead of a cluster that was
+     * then not fully written out) are ignored.
+     */
+    bool load_checkpoint(id segment) {
+        std::string path = m_reg.cluster_path(m_reg.m_current_cluster, ".chk");
+        if (!file::accessible(path)) return false;
+        long pos = m_file->tell();
+        m_file->seek(0, SEEK_END);
+        uint64_t data_size = m_file->tell();
+        m_file->seek(pos, SEEK_SET);
+        file checkpoints(path, true);
+        uint64_t cp_segment, cp_position;
+        int64_t cp_time;
+        long found = -1;
+        // sid and, for imported objects, the original address (the sid of which is never 0)
+        std::vector<std::pair<id, address>> entries;
+        try {
+            // find it
+            while (!checkpoints.eof()) {
+                uint32_t size;
+                deserialize(checkpoints, size);
+                long start = checkpoints.tell();
+                deserialize(checkpoints, cp_segment);
+                if (cp_segment > segment) break;
+                deserialize(checkpoints, cp_position);
+                if (cp_position <= data_size) found = start;
+                checkpoints.seek(start + size, SEEK_SET);
+            }
+            if (found < 0) return false;
+            checkpoints.seek(found, SEEK_SET);
+            deserialize(checkpoints, cp_segment);
+            deserialize(checkpoints, cp_position);
+            deserialize(checkpoints, cp_time);
+            id count = varint::decode(checkpoints);
+            entries.reserve(count);
+            id sid = 0;
+            for (id i = 0; i < count; ++i) {
+                sid += varint::decode(checkpoints);
+                if (sid >= cp_position) return false;
+                id delta = varint::decode(checkpoints);
+                address a{0, 0};
+                if (delta) {
+                    if (delta > m_reg.m_current_cluster) return false;
+                    a = address{m_reg.m_current_cluster - delta, varint::decode(checkpoints)};
+                }
+                entries.emplace_back(sid, a);
+            }
+        } catch (const io_error& err) {
+            // a partially written checkpoint
+            return false;
+        }
+        // load it
+        for (auto& kv : m_dictionary) kv.second->m_sid = unknownid;
+        m_dictionary.clear();
+        m_references.clear();
+        m_imported.clear();
+        m_uncarried.clear();
+        for (const auto& e : entries) {
+            if (e.second.sid) {
+                import(e.second, carried_object(e.second), e.first);
+            } else {
+                ptr object = handle<T>::make(m_arena.get(), this);
+                db<H, F>::fetch(object.get(), e.first);
+                m_dictionary[e.first] = object;
+                m_references[object->m_hash] = e.first;
+            }
+        }
+        m_file->seek(cp_position, SEEK_SET);
+        m_current_time = cp_time;
+        return true;
+    }
+
+    /**
+     * The object at the given address in an earlier cluster, from the carry-over table if it is
+     * there, and otherwise read from the cluster (through the file cache). Such objects never
+     * compress references (see enable_carry_over()), so they read without the cluster's context.
+     */
+    ptr carried_object(const address& a) {
+        auto it = m_carried.find(a);
+        if (it != m_carried.end()) return it->second.object;
+        ptr object = handle<T>::make(m_arena.get(), this);
+        file* origin = m_files.acquire(m_reg.cluster_path(a.cluster), m_ic.m_backend);
+        try {
+            origin->seek(a.sid, SEEK_SET);
+            *origin >> *object;
+        } catch (...) {
+            m_files.release(origin);
+            throw;
+        }
+        m_files.release(origin);
+        return object;
     }
 
-    id pop_reference()        { return derefer(); }
     H& pop_reference(H& hash) { return derefer(hash); }
 
     void pop_references(std::set<id>& known, std::set<H>& unknown) {
@@ -532,6 +1272,15 @@ public:
         derefer(known, unknown);
     }
 
+    /**
+     * Read past an unordered set of references.
+     */
+    void skip_references() {
+        id unknown = db<H, F>::derefer_known(m_scratch_sids);
+        H u;
+        for (id i = 0; i < unknown; ++i) db<H, F>::read_unknown(u);
+    }
+
     void pop_reference_hashes(std::set<H>& mixed) {
         std::set<id> known;
         pop_references(known, mixed);
@@ -541,32 +1290,140 @@ public:
         }
     }
 
-    // virtual void registry_opened_cluster(id cluster, file* file) override {
-    //     db<H>::registry_opened_cluster(cluster, file);
-    //     file->m_compressor = this;
-    // }
+    /**
+     * Vector variants of the above. The vectors are overwritten, not appended to, and may be
+     * reused between calls to avoid allocating. References come in the order they are on disk;
+     * for pop_reference_hashes, the known ones come first.
+     */
+    void pop_references(std::vector<id>& known, std::vector<H>& unknown) {
+        derefer(known, unknown);
+    }
+
+    void pop_reference_hashes(std::vector<H>& mixed) {
+        id unknown = db<H, F>::derefer_known(m_scratch_sids);
+        size_t known = m_scratch_sids.size();
+        mixed.resize(known + unknown);
+        for (size_t i = 0; i < known; ++i) {
+            auto it = m_dictionary.find(m_scratch_sids[i]);
+            if (it == m_dictionary.end()) {
+                throw std::out_of_range("pop_reference_hashes(): unknown key " + std::to_string(m_scratch_sids[i]));
+            }
+            mixed[i] = it->second->m_hash;
+        }
+        for (id i = 0; i < unknown; ++i) {
+            db<H, F>::read_unknown(mixed[known + i]);
+        }
+    }
+
+    virtual void registry_opened_cluster(id cluster, file* file) override {
+        db<H, F>::registry_opened_cluster(cluster, file);
+        m_next_time_mark = 0;
+        m_sidecar_size = -1;
+        // on success, the file is at its end, and resuming has nothing left to replay
+        if (m_sidecar_index && file && !file->readonly()) read_sidecar_index();
+    }
 
     virtual void registry_closing_cluster(id cluster) override {
-        db<H>::registry_closing_cluster(cluster);
+        db<H, F>::registry_closing_cluster(cluster);
+        if (m_sidecar_index) write_sidecar_index();
+        carry_over(cluster);
+        m_imported.clear();
+        m_uncarried.clear();
         for (auto& kv : m_dictionary) kv.second->m_sid = unknownid;
         m_dictionary.clear();
         m_references.clear();
+        if (m_arena) m_arena->reset();
         m_current_time = 0;
     }
 
     virtual void goto_segment(id segment_id) override {
         if (m_reg.prepare_cluster_for_segment(segment_id) != m_reg.m_current_cluster) {
-            // TODO: the time will be wrong when jumping to segments not evenly divisible with cluster size
             m_current_time = 0;
         }
-        db<H>::goto_segment(segment_id);
+        db<H, F>::goto_segment(segment_id);
+        const header& fi = m_reg.m_forward_index;
+        id segment = fi.has_segment(segment_id) ? segment_id : fi.get_first_segment();
+        if (m_checkpoints && fi.has_segment(segment)) {
+            id target = m_file->tell();
+            if (load_checkpoint(segment)) {
+                while ((id)m_file->tell() < target && this->registry_iterate(m_file));
+                assert((id)m_file->tell() == target);
+            }
+        }
+        // clusters with version 6+ headers know the time at the start of each segment; for older
+        // ones, the time is only right when jumping to the start of a cluster
+        if (fi.has_segment_time(segment)) m_current_time = fi.get_segment_time(segment);
+    }
+
+    /**
+     * Move to the first event at or after `time`, returning false if there is none. The cluster
+     * is found by a binary search over the first times in the clusters' time indices, and the
+     * position in it from its time index, from where the events before `time` are replayed
+     * (through registry_iterate()). With checkpoints enabled, this goes through goto_segment(),
+     * so that the dictionary is restored as well.
+     *
+     * Clusters are assumed to be in time order. Clusters written before time indices existed
+     * are replayed from their start.
+     */
+    bool goto_time(long time) {
+        const auto& cluster_set = m_reg.get_clusters().m;
+        if (cluster_set.empty()) return false;
+        std::vector<id> clusters(cluster_set.begin(), cluster_set.end());
+        // the last cluster whose first event is before `time`, or the first cluster
+        size_t lo = 0, hi = clusters.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) >> 1;
+            if (starts_before(clusters[mid], time)) lo = mid; else hi = mid;
+        }
+        id cluster = clusters[lo];
+        if (cluster != m_reg.m_current_cluster || !m_file || !m_file->readonly()) {
+            m_ic.open(cluster, true);
+            m_current_time = 0;
+        }
+        const header& fi = m_reg.m_forward_index;
+        const time_index::mark* m = fi.get_time_index().find(time);
+        if (m && m_checkpoints) {
+            goto_segment(m->segment);
+        } else if (m) {
+            m_file->seek(m->position, SEEK_SET);
+            m_current_time = m->clock;
+        } else {
+            m_file->seek(m_reg.m_data_start, SEEK_SET);
+            m_current_time = 0;
+        }
+        long next;
+        while (peek_time(next)) {
+            if (next >= time) return true;
+            if (!this->registry_iterate(m_file)) return false;
+        }
+        return false;
+    }
+
+    /**
+     * Whether the first event of the given cluster is before `time`, according to its time
+     * index. Clusters with headers older than time indices are assumed to be.
+     */
+    bool starts_before(id cluster, long time) {
+        if (cluster == m_reg.m_current_cluster) return starts_before(m_reg.m_forward_index, time);
+        const header* fi = m_reg.peek_forward_index(cluster);
+        return fi && starts_before(*fi, time);
+    }
+
+    static bool starts_before(const header& fi, long time) {
+        if (fi.get_version() < 7) return true;
+        const auto& marks = fi.get_time_index().marks;
+        return !marks.empty() && marks[0].time < time;
     }
 
     virtual void begin_segment(id segment_id) override {
         if (m_reg.prepare_cluster_for_segment(segment_id) != m_reg.m_current_cluster) {
             m_current_time = 0;
         }
-        db<H>::begin_segment(segment_id);
+        db<H, F>::begin_segment(segment_id);
+        m_reg.m_forward_index.mark_segment_time(segment_id, m_current_time);
+        if (m_checkpoint_interval && segment_id % m_checkpoint_interval == 0 && !m_references.empty()) {
+            write_checkpoint(segment_id);
+        }
 #ifdef USE_REFLECTION
         if (m_reflection) {
             flush();
@@ -578,14 +1435,17 @@ public:
 
 // db
 
-template<typename H> db<H>::db(const std::string& dbpath, const std::string& prefix, uint32_t cluster_size, bool readonly)
+template<typename H, typename F> db<H, F>::db(const std::string& dbpath, const std::string& prefix, uint32_t cluster_size, bool readonly, uint8_t backend)
     : m_dbpath(dbpath)
     , m_prefix(prefix)
     , m_reg(this, dbpath, prefix, cluster_size)
     , m_file(nullptr)
-    , m_ic(&m_reg, readonly)
+    , m_ic(&m_reg, readonly, file_traits<F>::backend(backend))
     , m_readonly(readonly)
+    , m_interning(false)
 {
+    if (!readonly && !file_traits<F>::writable) throw db_error("a db of readonly file type (e.g. mmap_file) must be opened readonly");
+    m_ic.set_cache(&m_files);
     if (!mkdir(m_dbpath)) {
         try {
             file regfile(m_dbpath + "/cq.registry", true);
@@ -600,16 +1460,16 @@ template<typename H> db<H>::db(const std::string& dbpath, const std::string& pre
     }
 }
 
-template<typename H> void db<H>::open(id cluster, bool readonly) {
+template<typename H, typename F> void db<H, F>::open(id cluster, bool readonly) {
     if (!readonly && m_readonly) throw db_error("readonly database");
     m_ic.open(cluster, readonly);
 }
 
-template<typename H> void db<H>::load() {
+template<typename H, typename F> void db<H, F>::load() {
     m_ic.resume(false);
 }
 
-template<typename H> db<H>::~db() {
+template<typename H, typename F> db<H, F>::~db() {
     if (!m_readonly) {
         file regfile(m_dbpath + "/cq.registry", false, true);
         regfile << m_reg;
@@ -617,18 +1477,39 @@ template<typename H> db<H>::~db() {
     m_ic.close();
 }
 
-template<typename H> void db<H>::registry_closing_cluster(id cluster) {}
+template<typename H, typename F> void db<H, F>::enable_interning() {
+    m_reg.m_header_flags |= HEADER_INTERNED;
+    m_reg.m_forward_index.set_flags(m_reg.m_header_flags);
+    if (m_file && !m_file->readonly() && !m_interning && (id)m_file->tell() == m_reg.m_data_start && m_reg.m_back_index.get_version() >= 5) {
+        // nothing written to the current cluster; the header keeps its size, so it is rewritten in place
+        m_reg.m_back_index.set_flags(m_reg.m_header_flags);
+        m_file->seek(0, SEEK_SET);
+        *m_file << m_reg.m_back_index;
+        assert((id)m_file->tell() == m_reg.m_data_start);
+        m_interning = true;
+    }
+}
+
+template<typename H, typename F> void db<H, F>::registry_closing_cluster(id cluster) {
+    m_interning = false;
+    m_interned.clear();
+    m_interned_at.clear();
+}
 
-template<typename H> void db<H>::registry_opened_cluster(id cluster, file* file) {
-    m_file = file;
+template<typename H, typename F> void db<H, F>::registry_opened_cluster(id cluster, file* file) {
+    m_file = dynamic_cast<F*>(file);
+    if (file && !m_file) throw db_error("cluster file " + file->get_path() + " is not of the db's file type");
     if (m_readonly) assert(m_file->readonly());
+    m_interning = file && (m_reg.m_back_index.get_flags() & HEADER_INTERNED);
+    // the next cluster has no data yet, and gets the flags we want for it
+    if (file && !file->readonly()) m_reg.m_forward_index.set_flags(m_reg.m_header_flags);
 }
 
 //
 // db registry
 //
 
-template<typename H> id db<H>::store(object<H>* t) {
+template<typename H, typename F> id db<H, F>::store(object<H>* t) {
     if (!m_file) throw db_error("invalid operation -- db not ready (no segment begun)");
     if (m_readonly) throw db_error("readonly database");
     if (m_file->readonly()) throw db_error("file is readonly");
@@ -639,7 +1520,7 @@ template<typename H> id db<H>::store(object<H>* t) {
     return rval;
 }
 
-template<typename H> void db<H>::load(object<H>* t) {
+template<typename H, typename F> void db<H, F>::load(object<H>* t) {
     assert(m_file);
     assert(t);
     id rval = m_file->tell();
@@ -647,7 +1528,7 @@ template<typename H> void db<H>::load(object<H>* t) {
     t->m_sid = rval;
 }
 
-template<typename H> void db<H>::fetch(object<H>* t, id i) {
+template<typename H, typename F> void db<H, F>::fetch(object<H>* t, id i) {
     assert(m_file);
     assert(t);
     long p = m_file->tell();
@@ -657,55 +1538,102 @@ template<typename H> void db<H>::fetch(object<H>* t, id i) {
     t->m_sid = i;
 }
 
-template<typename H> void db<H>::refer(id sid) {
+template<typename H, typename F> void db<H, F>::refer(id sid) {
     if (m_readonly) throw db_error("readonly database");
     assert(m_file);
     assert(sid < m_file->tell());
-    *m_file << varint(m_file->tell() - sid);
+    varint::encode(*m_file, m_file->tell() - sid);
 }
 
-template<typename H> void db<H>::refer(object<H>* t) {
+template<typename H, typename F> void db<H, F>::refer(object<H>* t) {
     if (m_readonly) throw db_error("readonly database");
     assert(m_file);
     assert(t);
     assert(t->m_sid != unknownid);
     assert(t->m_sid < m_file->tell());
-    *m_file << varint(m_file->tell() - t->m_sid);
+    varint::encode(*m_file, m_file->tell() - t->m_sid);
 }
 
-template<typename H> void db<H>::refer(const H& hash) {
+template<typename H, typename F> void db<H, F>::refer(const H& hash) {
     if (m_readonly) throw db_error("readonly database");
     assert(m_file);
-    serialize(*m_file, hash);
+    write_unknown(hash);
+}
+
+template<typename H, typename F> void db<H, F>::write_unknown(const H& hash) {
+    if (!m_interning) {
+        serialize(*m_file, hash);
+        return;
+    }
+    id pos = m_file->tell();
+    auto it = m_interned.find(hash);
+    if (it != m_interned.end()) {
+        varint::encode(*m_file, pos - it->second);
+    } else {
+        varint::encode(*m_file, (id)0);
+        serialize(*m_file, hash);
+        m_interned[hash] = pos;
+    }
+}
+
+template<typename H, typename F> void db<H, F>::read_unknown(H& hash) {
+    if (!m_interning) {
+        deserialize(*m_file, hash);
+        return;
+    }
+    id pos = m_file->tell();
+    id delta = varint::decode(*m_file);
+    if (delta == 0) {
+        deserialize(*m_file, hash);
+        m_interned_at[pos] = hash;
+        // when resuming a cluster for writing, the writer carries on from what was read
+        if (!m_file->readonly()) m_interned[hash] = pos;
+        return;
+    }
+    id at = pos - delta;
+    auto it = m_interned_at.find(at);
+    if (it != m_interned_at.end()) {
+        hash = it->second;
+        return;
+    }
+    // not seen, e.g. as we started reading after it; it is a zero byte followed by the hash
+    long resume = m_file->tell();
+    m_file->seek(at + 1, SEEK_SET);
+    deserialize(*m_file, hash);
+    m_file->seek(resume, SEEK_SET);
+    m_interned_at[at] = hash;
 }
 
-template<typename H> id db<H>::derefer() {
+template<typename H, typename F> id db<H, F>::derefer() {
     assert(m_file);
-    return m_file->tell() - varint::load(m_file);
+    return m_file->tell() - varint::decode(*m_file);
 }
 
-template<typename H> H& db<H>::derefer(H& hash) {
+template<typename H, typename F> H& db<H, F>::derefer(H& hash) {
     assert(m_file);
-    deserialize(*m_file, hash);
+    read_unknown(hash);
     return hash;
 }
 
-template<typename H> void db<H>::refer(object<H>** ts, size_t sz) {
+template<typename H, typename F> void db<H, F>::refer(object<H>** ts, size_t sz) {
     if (m_readonly) throw db_error("readonly database");
-    id known, unknown;
     assert(ts);
-    assert(sz < 65536);
-
-    known = 0;
-    size_t klist[sz];
-    size_t idx = 0;
+    m_scratch_sids.clear();
+    m_scratch_hashes.clear();
     for (size_t i = 0; i < sz; ++i) {
         if (ts[i]->m_sid) {
-            known++;
-            klist[idx++] = i;
+            m_scratch_sids.push_back(ts[i]->m_sid);
+        } else {
+            m_scratch_hashes.push_back(&ts[i]->m_hash);
         }
     }
-    unknown = sz - known;
+    refer_scratch();
+}
+
+template<typename H, typename F> void db<H, F>::refer_scratch() {
+    if (m_readonly) throw db_error("readonly database");
+    id known = m_scratch_sids.size();
+    id unknown = m_scratch_hashes.size();
 
     // bits:    purpose:
     // 0-3      1111 = known is 15 + a varint starting at next (available) byte, 0000~1110 = there are byte(bits) known (0-14)
@@ -718,50 +1646,86 @@ template<typename H> void db<H>::refer(object<H>** ts, size_t sz) {
         (  known_vi.byteval()     )
     |   (unknown_vi.byteval() << 4);
 
-    *m_file << multi_refer_header;
-    known_vi.cond_serialize(m_file);
-    unknown_vi.cond_serialize(m_file);
+    serialize(*m_file, multi_refer_header);
+    known_vi.cond_encode(*m_file);
+    unknown_vi.cond_encode(*m_file);
 
-    // write known objects
-    // TODO: binomial encoding etc
+    // write known objects (the sids are turned into deltas in place)
     id refpoint = m_file->tell();
-    for (id i = 0; i < known; ++i) {
-        *m_file << varint(refpoint - ts[klist[i]]->m_sid);
+    id* deltas = m_scratch_sids.data();
+    if (m_reg.m_back_index.get_version() < 3) {
+        for (id i = 0; i < known; ++i) {
+            deltas[i] = refpoint - deltas[i];
+        }
+        varint::encode_many(*m_file, deltas, known);
+    } else {
+        // newest first, as the distance to the refpoint followed by the gaps between them
+        std::sort(m_scratch_sids.begin(), m_scratch_sids.end(), std::greater<id>());
+        id prev = refpoint;
+        for (id i = 0; i < known; ++i) {
+            id sid = deltas[i];
+            deltas[i] = prev - sid;
+            prev = sid;
+        }
+        bitpacked::encode(m_file, deltas, known);
     }
     // write unknown object refs
-    for (id i = 0; i < sz; ++i) {
-        if (ts[i]->m_sid == unknownid) {
-            serialize(*m_file, ts[i]->m_hash);
-        }
+    for (const H* hash : m_scratch_hashes) {
+        write_unknown(*hash);
     }
 }
 
-template<typename H> void db<H>::derefer(std::set<id>& known_out,  std::set<H>& unknown_out) {
-    known_out.clear();
-    unknown_out.clear();
-
+template<typename H, typename F> id db<H, F>::derefer_known(std::vector<id>& known_out) {
     uint8_t multi_refer_header;
-    *m_file >> multi_refer_header;
-    cond_varint<4> known_vi(multi_refer_header & 0x0f, m_file);
-    cond_varint<4> unknown_vi(multi_refer_header >> 4, m_file);
+    deserialize(*m_file, multi_refer_header);
+    cond_varint<4> known_vi((id)0), unknown_vi((id)0);
+    known_vi.cond_decode(multi_refer_header & 0x0f, *m_file);
+    unknown_vi.cond_decode(multi_refer_header >> 4, *m_file);
     id known = known_vi.m_value;
-    id unknown = unknown_vi.m_value;
 
-    // read known objects
-    // TODO: binomial encoding etc
+    // read known objects (as deltas, turned into sids in place)
     id refpoint = m_file->tell();
-    for (id i = 0; i < known; ++i) {
-        known_out.insert(refpoint - varint::load(m_file));
+    known_out.resize(known);
+    id* sids = known_out.data();
+    if (m_reg.m_back_index.get_version() < 3) {
+        varint::decode_many(*m_file, sids, known);
+        for (id i = 0; i < known; ++i) {
+            sids[i] = refpoint - sids[i];
+        }
+    } else {
+        bitpacked::decode(m_file, sids, known);
+        id sid = refpoint;
+        for (id i = 0; i < known; ++i) {
+            sid -= sids[i];
+            sids[i] = sid;
+        }
     }
+    return unknown_vi.m_value;
+}
+
+template<typename H, typename F> void db<H, F>::derefer(std::set<id>& known_out,  std::set<H>& unknown_out) {
+    known_out.clear();
+    unknown_out.clear();
+    id unknown = derefer_known(m_scratch_sids);
+    known_out.insert(m_scratch_sids.begin(), m_scratch_sids.end());
     // read unknown refs
     for (id i = 0; i < unknown; ++i) {
         H h;
-        deserialize(*m_file, h);
+        read_unknown(h);
         unknown_out.insert(h);
     }
 }
 
-template<typename H> void db<H>::begin_segment(id segment_id) {
+template<typename H, typename F> void db<H, F>::derefer(std::vector<id>& known_out, std::vector<H>& unknown_out) {
+    id unknown = derefer_known(known_out);
+    // read unknown refs
+    unknown_out.resize(unknown);
+    for (id i = 0; i < unknown; ++i) {
+        read_unknown(unknown_out[i]);
+    }
+}
+
+template<typename H, typename F> void db<H, F>::begin_segment(id segment_id) {
     if (segment_id < m_reg.m_tip) throw db_error("may not begin a segment < current tip");
     id new_cluster = m_reg.prepare_cluster_for_segment(segment_id);
     assert(m_reg.m_tip == segment_id || !m_file);
@@ -770,14 +1734,23 @@ template<typename H> void db<H>::begin_segment(id segment_id) {
         write_reg = !m_readonly;
         m_ic.open(new_cluster, m_readonly);
     }
-    m_reg.m_forward_index.mark_segment(segment_id, m_file->tell());
+    m_reg.mark_segment(segment_id, m_file->tell());
     if (write_reg) {
         file regfile(m_dbpath + "/cq.registry", false, true);
         regfile << m_reg;
     }
 }
 
-template<typename H> void db<H>::goto_segment(id segment_id) {
+template<typename H, typename F> void db<H, F>::goto_segment(id segment_id) {
+    registry::segment_location location;
+    if (m_reg.find_segment(segment_id, location)) {
+        // headers are only read if the cluster changes
+        if (location.cluster != m_reg.m_current_cluster || !m_file) {
+            m_ic.open(location.cluster, true);
+        }
+        m_file->seek(location.position, SEEK_SET);
+        return;
+    }
     id new_cluster = m_reg.prepare_cluster_for_segment(segment_id);
     if (new_cluster != m_reg.m_current_cluster || !m_file) {
         m_ic.open(new_cluster, true);
@@ -795,7 +1768,7 @@ template<typename H> void db<H>::goto_segment(id segment_id) {
     m_file->seek(pos, SEEK_SET);
 }
 
-template<typename H> void db<H>::flush() {
+template<typename H, typename F> void db<H, F>::flush() {
     if (m_readonly) throw db_error("readonly database");
     assert(m_ic.m_file == m_file);
     m_ic.flush();
@@ -2,6 +2,7 @@
 #define included_cq_io_h_
 
 #include <string>
+#include <stdexcept>
 #include <map>
 #include <set>
 #include <vector>
@@ -17,6 +18,10 @@
 #   include <tchar.h>
 #else
 #   include <dirent.h>
+#   include <atomic>
+#   include <condition_variable>
+#   include <mutex>
+#   include <thread>
 #endif
 
 namespace cq {
@@ -39,9 +44,11 @@ constexpr id nullid = 0xffffffffffffffff;
 template<typename T, typename Stream> void serialize(Stream& stm, const std::vector<T>& vec);
 template<typename T, typename Stream> void deserialize(Stream& stm, std::vector<T>& vec);
 
+// these call into the stream directly (rather than through serializer::w/r) so that calls on
+// concrete stream types resolve statically
 #define S(T) \
-    template<typename Stream> void serialize(Stream& stm, T t) { stm.w(t); } \
-    template<typename Stream> void deserialize(Stream& stm, T& t) { stm.r(t); }
+    template<typename Stream> void serialize(Stream& stm, T t) { stm.write((const uint8_t*)&t, sizeof(T)); } \
+    template<typename Stream> void deserialize(Stream& stm, T& t) { stm.read((uint8_t*)&t, sizeof(T)); }
 S(uint8_t); S(uint16_t); S(uint32_t); S(uint64_t); S(int8_t); S(int16_t); S(int32_t); S(int64_t);
 #undef S
 
@@ -52,9 +59,24 @@ public:
     virtual bool empty() { return tell() == 0 && eof(); }
     virtual size_t write(const uint8_t* data, size_t len) { throw io_error("write-only stream"); /* override to make writeable */ }
     virtual size_t read(uint8_t* data, size_t len) { throw io_error("readonly stream"); /* override to make readable */ }
+    /**
+     * Status-returning read: read exactly `len` bytes and return true, or return false if the
+     * stream does not have `len` more bytes, in which case the position is left untouched.
+     * Unlike read(), running into the end of the stream is not an exceptional condition here.
+     */
+    virtual bool try_read(uint8_t* data, size_t len);
     virtual void seek(long offset, int whence) { throw io_error("non-seekable stream"); /* override to make seekable */ }
     virtual long tell()  { throw io_error("stream without tell support"); /* override to make tellable */ }
+    /**
+     * Zero-copy access to the stream content at the current position. Returns a pointer to the
+     * next `avail` contiguous bytes, or nullptr (and avail = 0) if the stream is unable to provide
+     * direct access (or has no more data). The pointer is only valid until the next operation on
+     * the stream. The position is not advanced; call skip() to consume.
+     */
+    virtual const uint8_t* view(size_t& avail) { avail = 0; return nullptr; }
+    virtual void skip(size_t len) { seek(len, SEEK_CUR); }
     uint8_t get_uint8();
+    inline bool try_get_uint8(uint8_t& v) { return try_read(&v, 1); }
     virtual void flush() {}
 
     // bitcoin core compatibility
@@ -100,26 +122,138 @@ struct varint : public serializable {
     explicit varint(serializer* s) { deserialize(s); }
     prepare_for_serialization();
     static inline id load(serializer* s) { varint v(s); return v.m_value; }
+
+    /**
+     * Templated encoding and decoding. When Stream is a concrete (final) stream type, the calls
+     * into the stream resolve statically and the whole encoding can be inlined into the caller;
+     * the serializable interface above uses these with the virtual serializer.
+     */
+    template<typename Stream> static inline void encode(Stream& stm, id value) {
+        uint8_t tmp[10];
+        stm.write(tmp, encode(value, tmp));
+    }
+    template<typename Stream> static inline id decode(Stream& stm) {
+        id value = 0;
+        size_t avail;
+        const uint8_t* p = stm.view(avail);
+        // decode straight out of the stream's buffer, as long as the varint is fully inside it
+        for (size_t i = 0; i < avail; ++i) {
+            if (step(value, p[i])) {
+                stm.skip(i + 1);
+                return value;
+            }
+        }
+        value = 0;
+        uint8_t chData;
+        do {
+            stm.read(&chData, 1);
+        } while (!step(value, chData));
+        return value;
+    }
+
+    /**
+     * Encode `value` into `buf`, which must have room for 10 bytes, returning the number of bytes
+     * used.
+     */
+    static inline size_t encode(id value, uint8_t* buf) {
+        uint8_t tmp[10];
+        int nel = 10;
+        for (;;) {
+            --nel;
+            tmp[nel] = (value & 0x7F) | (nel == 9 ? 0x00 : 0x80);
+            if (value <= 0x7F) break;
+            value = (value >> 7) - 1;
+        }
+        memcpy(buf, &tmp[nel], 10 - nel);
+        return 10 - nel;
+    }
+
+    /**
+     * Bulk encoding of `count` values into `out`, which must have room for 10 bytes per value.
+     * Returns the number of bytes written.
+     */
+    static size_t encode_many(const id* values, size_t count, uint8_t* out);
+
+    /**
+     * Bulk decoding of up to `count` varints from the `len` bytes at `data`. On return, `count`
+     * holds the number of values decoded, which stops short if the buffer ends (or ends in the
+     * middle of a varint). Returns the number of bytes consumed.
+     *
+     * Runs of single byte varints, which make up the bulk of delta encoded id sequences, are
+     * detected 16 bytes at a time and widened using SSE2/AVX2 where available.
+     */
+    static size_t decode_many(const uint8_t* data, size_t len, id* values, size_t& count);
+
+    template<typename Stream> static inline void encode_many(Stream& stm, const id* values, size_t count) {
+        uint8_t buf[640];
+        while (count) {
+            size_t n = count < 64 ? count : 64;
+            stm.write(buf, encode_many(values, n, buf));
+            values += n;
+            count -= n;
+        }
+    }
+
+    template<typename Stream> static inline void decode_many(Stream& stm, id* values, size_t count) {
+        while (count) {
+            size_t avail, n = count;
+            const uint8_t* p = stm.view(avail);
+            if (p) {
+                size_t used = decode_many(p, avail, values, n);
+                if (used) stm.skip(used);
+            } else {
+                n = 0;
+            }
+            values += n;
+            count -= n;
+            if (count && !n) {
+                // no view, or the varint straddles its end
+                *values++ = decode(stm);
+                --count;
+            }
+        }
+    }
+
+    /**
+     * Feed the byte `chData` into `value`. Returns true if this was the final byte of the varint.
+     */
+    static inline bool step(id& value, uint8_t chData) {
+        if (value > (nullid >> 7)) throw io_error("varint::deserialize(): size too large");
+        value = (value << 7) | (chData & 0x7F);
+        if (chData & 0x80) {
+            if (value == nullid) throw io_error("varint::deserialize(): size too large");
+            value++;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Load a varint into `value`, returning false if the stream ends before the varint does. The
+     * stream position is undefined on failure, and callers should seek back to a known position.
+     * Malformed varints still throw.
+     */
+    static bool try_load(serializer* s, id& value);
 };
 
 template<typename Stream> void serialize(Stream& stm, const std::string& str) {
-    varint(str.size()).serialize(&stm);
+    varint::encode(stm, str.size());
     stm.write((const uint8_t*)str.data(), str.size());
 }
 
 template<typename Stream> void deserialize(Stream& stm, std::string& str) {
-    size_t sz = varint::load(&stm);
+    size_t sz = varint::decode(stm);
     str.resize(sz);
     stm.read((uint8_t*)str.data(), sz);
 }
 
 template<typename T, typename Stream> void serialize(Stream& stm, const std::vector<T>& vec) {
-    varint(vec.size()).serialize(&stm);
+    varint::encode(stm, vec.size());
     for (const T& v : vec) serialize(stm, v);
 }
 
 template<typename T, typename Stream> void deserialize(Stream& stm, std::vector<T>& vec) {
-    vec.resize(varint::load(&stm));
+    vec.resize(varint::decode(stm));
     for (size_t i = 0; i < vec.size(); ++i) deserialize(stm, vec[i]);
 }
 
@@ -155,21 +289,14 @@ public:
         cond_deserialize(val, s);
     }
     uint8_t byteval() const override { return m_value < CAP ? m_value : CAP; }
-    void cond_serialize(serializer* stream) const override {
-        if (m_value >= CAP) {
-            const_cast<cond_varint*>(this)->m_value -= CAP;
-            varint::serialize(stream);
-            const_cast<cond_varint*>(this)->m_value += CAP;
-        }
+    template<typename Stream> inline void cond_encode(Stream& stm) const {
+        if (m_value >= CAP) varint::encode(stm, m_value - CAP);
     }
-    void cond_deserialize(uint8_t val, serializer* stream) override {
-        if (val < CAP) {
-            m_value = val;
-        } else {
-            varint::deserialize(stream);
-            m_value += CAP;
-        }
+    template<typename Stream> inline void cond_decode(uint8_t val, Stream& stm) {
+        m_value = val < CAP ? val : CAP + varint::decode(stm);
     }
+    void cond_serialize(serializer* stream) const override { cond_encode(*stream); }
+    void cond_deserialize(uint8_t val, serializer* stream) override { cond_decode(val, *stream); }
     void serialize(serializer* stream) const override {
         uint8_t val = m_value < CAP ? m_value : CAP;
         stream->w(val);
@@ -184,20 +311,39 @@ public:
 
 template<typename H> class compressor {
 public:
-    virtual void compress(serializer* stm, const std::vector<H>& references) { varint(references.size()).serialize(stm); for (const auto& u : references) serialize(*stm, u); }
+    virtual void compress(serializer* stm, const std::vector<H>& references) { varint::encode(*stm, references.size()); for (const auto& u : references) serialize(*stm, u); }
     virtual void compress(serializer* stm, const H& reference) { serialize(*stm, reference); }
-    virtual void decompress(serializer* stm, std::vector<H>& references) { id c = varint::load(stm); references.resize(c); for (id i = 0; i < c; ++i) deserialize(*stm, references[i]); }
+    virtual void decompress(serializer* stm, std::vector<H>& references) { id c = varint::decode(*stm); references.resize(c); for (id i = 0; i < c; ++i) deserialize(*stm, references[i]); }
     virtual void decompress(serializer* stm, H& reference) { deserialize(*stm, reference); }
 };
 
+/**
+ * Block bitpacking of id sequences (typically deltas). The values are split into blocks of
+ * BLOCK values, each written as one byte holding the bit width of the largest value in the
+ * block, followed by all the values packed LSB first at that width. A trailing block shorter
+ * than MIN_TAIL values is written as plain varints instead, as the width byte and the padding
+ * would outweigh the gain. The number of values is not written, and must be known to the reader.
+ */
+struct bitpacked {
+    static constexpr size_t BLOCK = 128;
+    static constexpr size_t MIN_TAIL = 16;
+    static void encode(serializer* stream, const id* values, size_t count);
+    static void decode(serializer* stream, id* values, size_t count);
+};
+
 /**
  * Incmaps are efficiently encoded maps linking two ordered sequences together. The two
  * sequences must be increasing s.t. each key and value can be expressed as the previous
  * key and value + positive integers (one for the key and one for the value).
+ *
+ * The versioned (de)serializers take the version of the enclosing format: version 1 writes
+ * the deltas as varints, version 2 and up as bitpacked blocks. The plain ones use version 1.
  */
 struct incmap : public serializable {
     std::map<id, id> m;
     prepare_for_serialization();
+    void serialize(serializer* stream, uint8_t version) const;
+    void deserialize(serializer* stream, uint8_t version);
     bool operator==(const incmap& other) const;
     inline id at(id v) const { return m.at(v); }
     inline size_t count(id v) const { return m.count(v); }
@@ -208,6 +354,8 @@ struct incmap : public serializable {
 struct unordered_set : public serializable {
     std::set<id> m;
     prepare_for_serialization();
+    void serialize(serializer* stream, uint8_t version) const;     //!< see incmap
+    void deserialize(serializer* stream, uint8_t version);
     unordered_set() {}
     unordered_set(id* ids, size_t sz) { for (size_t i =0; i < sz; ++i) m.insert(ids[i]); }
     unordered_set(const std::set<id>& ids) { m.insert(ids.begin(), ids.end()); }
@@ -216,31 +364,281 @@ struct unordered_set : public serializable {
     inline void clear() noexcept { m.clear(); }
 };
 
+/**
+ * Backends available for cluster files. The stdio backend is the default. The posix backend
+ * bypasses stdio and talks to the file descriptor directly through pread/pwrite, with its own
+ * write-coalescing and read-ahead buffers, which is considerably cheaper for the many 1-3 byte
+ * writes and reads performed by varints and event headers. The ring backend hands writes to
+ * an I/O thread (see ring_file).
+ */
+enum file_backend : uint8_t {
+    stdio_backend = 0,
+    posix_backend = 1,
+    mmap_backend  = 2,              //!< memory map readonly files; may be combined with posix_backend, which is then used for writable files
+    ring_backend  = 4,              //!< write writable files behind, on an I/O thread; may be combined with the other backends for readonly files
+};
+
 class file : public serializer {
-private:
+protected:
     long m_tell;
+    long m_size;                    //!< size of the file as known to us; updated on writes and refreshed on reopen()
     bool m_readonly;
     FILE* m_fp;
+    long m_fpos;                    //!< position of m_fp, or -1 if unknown; it is moved to m_tell lazily, before the next read or write
+    bool m_writing;                 //!< the last stdio operation was a write (switching direction requires repositioning)
     std::string m_path;
+    file() : m_tell(0), m_size(0), m_readonly(false), m_fp(nullptr), m_fpos(-1), m_writing(false) {} //!< for subclasses managing their own handle
+    void position(long offset, int whence); //!< update m_tell as per seek(), clamped to [0, m_size]
+    void sync(bool writing);                //!< reposition m_fp at m_tell if needed, before reading or writing
 public:
     file(FILE* fp);
     file(const std::string& path, bool readonly, bool clear = false);
     static bool accessible(const std::string& path);
     ~file() override;
-    bool eof() override;
+    bool eof() override { return m_tell >= m_size; }
     using serializer::write;
     using serializer::read;
     size_t write(const uint8_t* data, size_t len) override;
     size_t read(uint8_t* data, size_t len) override;
+    bool try_read(uint8_t* data, size_t len) noexcept override;
     void seek(long offset, int whence) override;
     long tell() override;
     void flush() override { fflush(m_fp); }
     bool readonly() const { return m_readonly; }
     const std::string& get_path() const { return m_path; }
-    void reopen();
+    /**
+     * Reopen the file and refresh its size. eof() and seek() never touch the disk, so readers
+     * tailing a file that is being appended to elsewhere must reopen() to see the new data.
+     */
+    virtual void reopen();
 };
 
-class chv_stream : public serializer {
+#ifndef _WIN32
+/**
+ * File descriptor based file stream. The kernel file offset is never used; all I/O is done
+ * using pread/pwrite at the tracked position. Contiguous writes are coalesced in a buffer and
+ * only hit the disk on flush(), when the buffer fills up, or when a read needs the data.
+ *
+ * The class is final and the common cases (appending to the write buffer, reading out of the
+ * read buffer) are inline, so code templated on posix_file compiles down to memcpy's.
+ */
+class posix_file final : public file {
+private:
+    int m_fd;
+    std::vector<uint8_t> m_wbuf;    //!< write buffer; m_wlen bytes pending for file position m_wpos
+    size_t m_wlen;
+    long m_wpos;
+    std::vector<uint8_t> m_rbuf;    //!< read-ahead buffer; m_rlen bytes valid from file position m_rpos, never past m_size
+    size_t m_rlen;
+    long m_rpos;
+    void write_out(const uint8_t* data, size_t len, long pos);
+    void flush_writes();
+    size_t write_slow(const uint8_t* data, size_t len);
+    bool try_read_slow(uint8_t* data, size_t len) noexcept;
+    const uint8_t* view_slow(size_t& avail);
+public:
+    static constexpr size_t BUFFER_SIZE = 65536;
+    posix_file(const std::string& path, bool readonly, bool clear = false, size_t buffer_size = BUFFER_SIZE);
+    ~posix_file() override;
+    inline size_t write(const char* data, size_t len) { return write((const uint8_t*)data, len); }
+    inline size_t read(char* data, size_t len) { return read((uint8_t*)data, len); }
+    size_t write(const uint8_t* data, size_t len) override {
+        // appending to the pending writes, past anything in the read buffer
+        if (m_wlen && m_wpos + (long)m_wlen == m_tell && m_wlen + len <= m_wbuf.size()
+            && (m_tell >= m_rpos + (long)m_rlen || m_tell + (long)len <= m_rpos)) {
+            memcpy(&m_wbuf[m_wlen], data, len);
+            m_wlen += len;
+            m_tell += len;
+            if (m_tell > m_size) m_size = m_tell;
+            return len;
+        }
+        return write_slow(data, len);
+    }
+    bool try_read(uint8_t* data, size_t len) noexcept override {
+        if (!m_wlen && m_tell >= m_rpos && m_tell + (long)len <= m_rpos + (long)m_rlen) {
+            memcpy(data, &m_rbuf[m_tell - m_rpos], len);
+            m_tell += len;
+            return true;
+        }
+        return try_read_slow(data, len);
+    }
+    size_t read(uint8_t* data, size_t len) override {
+        if (!try_read(data, len)) throw io_error("end of file");
+        return len;
+    }
+    void seek(long offset, int whence) override { position(offset, whence); }
+    long tell() override { return m_tell; }
+    const uint8_t* view(size_t& avail) override {
+        if (!m_wlen && m_tell >= m_rpos && m_tell < m_rpos + (long)m_rlen) {
+            avail = m_rlen - (m_tell - m_rpos);
+            return &m_rbuf[m_tell - m_rpos];
+        }
+        return view_slow(avail);
+    }
+    void skip(size_t len) override { position(len, SEEK_CUR); }
+    void flush() override { flush_writes(); }
+    void reopen() override;
+};
+
+/**
+ * Readonly memory mapped file stream. Reads are plain copies out of the mapping, and view()
+ * gives decoders direct access to the mapped pages. The mapping covers the file as it was when
+ * opened; reopen() remaps it to pick up data appended since.
+ */
+class mmap_file final : public file {
+private:
+    int m_fd;
+    const uint8_t* m_map;
+    void map();
+    void unmap();
+public:
+    mmap_file(const std::string& path);
+    ~mmap_file() override;
+    using serializer::write;
+    inline size_t read(char* data, size_t len) { return read((uint8_t*)data, len); }
+    size_t write(const uint8_t*, size_t) override { throw io_error("readonly stream"); }
+    bool try_read(uint8_t* data, size_t len) noexcept override {
+        if (m_tell + (long)len > m_size) return false;
+        memcpy(data, &m_map[m_tell], len);
+        m_tell += len;
+        return true;
+    }
+    size_t read(uint8_t* data, size_t len) override {
+        if (!try_read(data, len)) throw io_error("end of file");
+        return len;
+    }
+    void seek(long offset, int whence) override { position(offset, whence); }
+    long tell() override { return m_tell; }
+    const uint8_t* view(size_t& avail) override {
+        avail = m_tell < m_size ? m_size - m_tell : 0;
+        return avail ? &m_map[m_tell] : nullptr;
+    }
+    void skip(size_t len) override { position(len, SEEK_CUR); }
+    void flush() override {}
+    void reopen() override;
+};
+
+/**
+ * Writable file stream which writes behind: appended data is copied into a lock-free single
+ * producer, single consumer ring, and a dedicated I/O thread drains the ring into the file, so
+ * that the writing thread does not wait on the disk. If the ring is full, the writer waits for
+ * the I/O thread to make room. Everything else (seeks followed by writes elsewhere, reads) waits
+ * for the ring to drain first, and is then done directly, so the stream behaves like any other;
+ * it is just only fast at appending. flush() waits until everything written is on disk.
+ *
+ * Errors on the I/O thread are reported by the next call that waits for the ring to drain.
+ */
+class ring_file final : public file {
+private:
+    int m_fd;
+    std::vector<uint8_t> m_ring;
+    size_t m_mask;
+    long m_origin;                  //!< file position of ring offset 0; only changed while drained
+    std::atomic<uint64_t> m_head;   //!< bytes put into the ring (by the writer)
+    std::atomic<uint64_t> m_tail;   //!< bytes written out of the ring (by the I/O thread)
+    std::atomic<bool> m_idle;       //!< the I/O thread is (about to go) to sleep; cleared by whoever wakes it
+    std::atomic<bool> m_waiting;    //!< the writer is waiting for the I/O thread to catch up
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_failed;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;         //!< the I/O thread waits on this while idle
+    std::condition_variable m_caught_up;    //!< the writer waits on this while waiting
+    std::thread m_thread;
+    std::vector<uint8_t> m_rbuf;    //!< read-ahead buffer, filled after draining; m_rlen bytes valid from file position m_rpos, never past m_size
+    size_t m_rlen;
+    long m_rpos;
+    void run();
+    void wake();
+    void await_tail(uint64_t tail);     //!< block until at least `tail` bytes have been written out
+    void drain();
+    void write_out(const uint8_t* data, size_t len, long pos);
+    size_t write_slow(const uint8_t* data, size_t len);
+    bool try_read_slow(uint8_t* data, size_t len) noexcept;
+    const uint8_t* view_slow(size_t& avail);
+public:
+    static constexpr size_t RING_SIZE = 1 << 20;
+    ring_file(const std::string& path, bool clear = false, size_t ring_size = RING_SIZE); //!< ring_size is rounded up to a power of two
+    ~ring_file() override;
+    using serializer::write;
+    using serializer::read;
+    size_t write(const uint8_t* data, size_t len) override {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        // appending, with room in the ring, past anything in the read buffer
+        if (m_tell == m_origin + (long)head && len <= m_ring.size() - (head - m_tail.load(std::memory_order_acquire))
+            && (m_tell >= m_rpos + (long)m_rlen || m_tell + (long)len <= m_rpos)) {
+            size_t offset = head & m_mask;
+            size_t first = m_ring.size() - offset;
+            if (first >= len) {
+                memcpy(&m_ring[offset], data, len);
+            } else {
+                memcpy(&m_ring[offset], data, first);
+                memcpy(&m_ring[0], data + first, len - first);
+            }
+            // sequentially consistent, as is run()'s going idle, so that either this sees the I/O
+            // thread idle, or it sees the new head; only the first append to see it idle wakes it
+            m_head.store(head + len);
+            if (m_idle.load() && m_idle.exchange(false)) wake();
+            m_tell += len;
+            if (m_tell > m_size) m_size = m_tell;
+            return len;
+        }
+        return write_slow(data, len);
+    }
+    size_t read(uint8_t* data, size_t len) override {
+        if (!try_read(data, len)) throw io_error("end of file");
+        return len;
+    }
+    bool try_read(uint8_t* data, size_t len) noexcept override {
+        if (m_tell >= m_rpos && m_tell + (long)len <= m_rpos + (long)m_rlen) {
+            memcpy(data, &m_rbuf[m_tell - m_rpos], len);
+            m_tell += len;
+            return true;
+        }
+        return try_read_slow(data, len);
+    }
+    const uint8_t* view(size_t& avail) override {
+        if (m_tell >= m_rpos && m_tell < m_rpos + (long)m_rlen) {
+            avail = m_rlen - (m_tell - m_rpos);
+            return &m_rbuf[m_tell - m_rpos];
+        }
+        return view_slow(avail);
+    }
+    void seek(long offset, int whence) override { position(offset, whence); }
+    long tell() override { return m_tell; }
+    void skip(size_t len) override { position(len, SEEK_CUR); }
+    void flush() override;
+    void reopen() override;
+    size_t pending() const { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire); }
+};
+#endif // _WIN32
+
+/**
+ * Open the file at `path` using the given backend.
+ */
+file* open_file(const std::string& path, bool readonly, bool clear = false, uint8_t backend = stdio_backend);
+
+/**
+ * Maps the file type a db or chronology is instantiated with to the backend it needs its
+ * cluster files to be opened with. The generic cq::file accepts whatever was requested; the
+ * concrete (final) file types force their own backend. As mmap_file is readonly, a db or
+ * chronology instantiated with it can only be opened readonly.
+ */
+template<typename F> struct file_traits {
+    static constexpr bool writable = true;
+    static uint8_t backend(uint8_t requested) { return requested; }
+};
+#ifndef _WIN32
+template<> struct file_traits<posix_file> {
+    static constexpr bool writable = true;
+    static uint8_t backend(uint8_t) { return posix_backend; }
+};
+template<> struct file_traits<mmap_file> {
+    static constexpr bool writable = false;
+    static uint8_t backend(uint8_t) { return mmap_backend; }
+};
+#endif // _WIN32
+
+class chv_stream final : public serializer {
 private:
     long m_tell{0};
     std::vector<uint8_t> m_chv;
@@ -248,8 +646,10 @@ public:
     bool eof() override;
     size_t write(const uint8_t* data, size_t len) override;
     size_t read(uint8_t* data, size_t len) override;
+    bool try_read(uint8_t* data, size_t len) noexcept override;
     void seek(long offset, int whence) override;
     long tell() override;
+    const uint8_t* view(size_t& avail) override;
     void clear() { m_chv.clear(); m_tell = 0; }
     std::vector<uint8_t>& get_chv() { return m_chv; }
     std::string to_string() const override {
@@ -262,6 +662,52 @@ public:
     }
 };
 
+/**
+ * A bounded LRU cache of open readonly files, so that moving back and forth between a handful of
+ * clusters does not reopen (and remap) their files every time. Files handed out by acquire() are
+ * in use until handed back with release(); at most `budget` files are kept open, and the least
+ * recently released ones are closed first when the budget is exceeded. Files in use are never
+ * closed, but count towards the budget. A budget of 0 disables caching.
+ *
+ * Only files that no longer change should go through the cache, as a cached file is not reopened,
+ * and so does not see data appended to it since it was first opened.
+ */
+class file_cache {
+private:
+    struct entry {
+        std::string path;
+        uint8_t backend;
+        file* f;
+        bool in_use;
+        uint64_t stamp;
+    };
+    std::vector<entry> m_entries;
+    size_t m_budget;
+    uint64_t m_clock;
+    void evict();
+public:
+    uint64_t m_hits;
+    uint64_t m_misses;
+    explicit file_cache(size_t budget = 8) : m_budget(budget), m_clock(0), m_hits(0), m_misses(0) {}
+    ~file_cache() { clear(); }
+    file_cache(const file_cache&) = delete;
+    file_cache& operator=(const file_cache&) = delete;
+
+    /**
+     * Get the readonly file at `path`, opened with the given backend, positioned at the start.
+     */
+    file* acquire(const std::string& path, uint8_t backend);
+    /**
+     * Hand back a file obtained from acquire(). Files which did not come from the cache are
+     * deleted.
+     */
+    void release(file* f);
+    void set_budget(size_t budget) { m_budget = budget; evict(); }
+    size_t get_budget() const { return m_budget; }
+    size_t size() const { return m_entries.size(); }
+    void clear(); //!< close all files not in use
+};
+
 class cluster_delegate {
 public:
     virtual ~cluster_delegate() {}
@@ -278,7 +724,9 @@ public:
     file* m_file;
     cluster_delegate* m_delegate;
     bool m_readonly;
-    cluster(cluster_delegate* delegate, bool readonly);
+    uint8_t m_backend;
+    file_cache* m_cache;    //!< if set, readonly files of clusters that have been moved past are kept in here
+    cluster(cluster_delegate* delegate, bool readonly, uint8_t backend = stdio_backend);
     ~cluster() override;
     virtual void open(id cluster, bool readonly, bool clear = false);
     virtual void close() {}
@@ -286,9 +734,20 @@ public:
     bool eof() override;
     size_t write(const uint8_t* data, size_t len) override;
     size_t read(uint8_t* data, size_t len) override;
+    bool try_read(uint8_t* data, size_t len) override; //!< moves on to the next cluster at the end of a file, which may throw
     void seek(long offset, int whence) override;
     long tell() override;
+    const uint8_t* view(size_t& avail) override { return m_file ? m_file->view(avail) : serializer::view(avail); }
+    void skip(size_t len) override { m_file->skip(len); }
     virtual void flush() override { m_file->flush(); }
+    void set_cache(file_cache* cache) { m_cache = cache; }
+protected:
+    /**
+     * Open the file of the given cluster, through the cache if it is readonly and no longer being
+     * written to (i.e. a later cluster exists).
+     */
+    file* open_cluster_file(id cluster, bool readonly, bool clear = false);
+    void close_file(file* f);
 };
 
 class indexed_cluster_delegate : public cluster_delegate {
@@ -300,6 +759,17 @@ public:
      */
     virtual void cluster_write_forward_index(id cluster, file* file) =0;
 
+    /**
+     * Bring the forward index of the data block being written (`cluster`) up to date in the
+     * given `file`, which is empty when first given, and is kept open for as long as the data
+     * block is being written. When the data block is closed, the index is written anew using
+     * cluster_write_forward_index(). By default, the index is rewritten every time.
+     */
+    virtual void cluster_log_forward_index(id cluster, file* file) {
+        file->seek(0, SEEK_SET);
+        cluster_write_forward_index(cluster, file);
+    }
+
     virtual void cluster_read_forward_index(id cluster, file* file) =0;
 
     virtual void cluster_clear_forward_index(id cluster) =0;
@@ -353,9 +823,11 @@ public:
     using cluster::m_file;
     using cluster::m_readonly;
     indexed_cluster_delegate* m_delegate;
-    indexed_cluster(indexed_cluster_delegate* delegate, bool readonly) : cluster(delegate, readonly) {
+    file* m_index_file;     //!< the forward index of the cluster being written, kept open between flushes
+    indexed_cluster(indexed_cluster_delegate* delegate, bool readonly, uint8_t backend = stdio_backend) : cluster(delegate, readonly, backend), m_index_file(nullptr) {
         m_delegate = delegate;
     }
+    ~indexed_cluster() override { if (m_index_file) delete m_index_file; }
     void open(id cluster, bool readonly, bool clear = false) override;
     virtual void close() override;
     virtual void flush() override;
@@ -379,8 +851,10 @@ struct bitfield : public serializable {
     inline bool operator[](size_t idx) const { return bool(G(idx)); }
     inline void set(size_t idx) { S(idx); }
     inline void unset(size_t idx) { U(idx); }
-    virtual void serialize(serializer* stream) const override { stream->write(m_data, m_cap); }
-    virtual void deserialize(serializer* stream) override     { stream->read(m_data, m_cap); }
+    template<typename Stream> inline void encode(Stream& stm) const { stm.write(m_data, m_cap); }
+    template<typename Stream> inline void decode(Stream& stm) { stm.read(m_data, m_cap); }
+    virtual void serialize(serializer* stream) const override { encode(*stream); }
+    virtual void deserialize(serializer* stream) override     { decode(*stream); }
 
     #undef S
     #undef U
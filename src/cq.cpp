@@ -4,14 +4,74 @@ extern "C" { void libcqdb_is_present(void) {} } // hello autotools, pleased to m
 
 namespace cq {
 
+// time index
+
+void time_index::serialize(serializer* stream, uint8_t) const {
+    // VARINT : number of marks
+    size_t size = marks.size();
+    *stream << varint((id)size);
+    if (!size) return;
+    // columns of deltas from the previous mark (and the lag of the clock behind the time), packed
+    // separately as they differ a lot in size
+    std::vector<id> deltas(size << 2);
+    id* times = deltas.data();
+    id* lags = times + size;
+    id* positions = lags + size;
+    id* segments = positions + size;
+    long lt = 0;
+    id lp = 0, ls = 0;
+    for (size_t i = 0; i < size; ++i) {
+        const mark& m = marks[i];
+        assert(m.time >= lt && m.position >= lp && m.segment >= ls && m.clock <= m.time);
+        times[i] = m.time - lt;
+        lags[i] = m.time - m.clock;
+        positions[i] = m.position - lp;
+        segments[i] = m.segment - ls;
+        lt = m.time;
+        lp = m.position;
+        ls = m.segment;
+    }
+    for (size_t col = 0; col < 4; ++col) bitpacked::encode(stream, deltas.data() + col * size, size);
+}
+
+void time_index::deserialize(serializer* stream, uint8_t) {
+    size_t size = varint::load(stream);
+    marks.resize(size);
+    if (!size) return;
+    std::vector<id> deltas(size << 2);
+    for (size_t col = 0; col < 4; ++col) bitpacked::decode(stream, deltas.data() + col * size, size);
+    const id* times = deltas.data();
+    const id* lags = times + size;
+    const id* positions = lags + size;
+    const id* segments = positions + size;
+    long lt = 0;
+    id lp = 0, ls = 0;
+    for (size_t i = 0; i < size; ++i) {
+        mark& m = marks[i];
+        m.time = lt += times[i];
+        m.clock = m.time - lags[i];
+        m.position = lp += positions[i];
+        m.segment = ls += segments[i];
+    }
+}
+
 // header
 
-header::header(uint8_t version, id cluster) : m_cluster(cluster), m_version(version) {}
+// log records
+static const uint8_t LOG_SEGMENT      = 1;  // segment, position
+static const uint8_t LOG_SEGMENT_TIME = 2;  // segment, time
+static const uint8_t LOG_TIME_MARK    = 3;  // time, time - clock, position, segment
+
+header::header(uint8_t version, id cluster) : m_cluster(cluster), m_version(version), m_flags(0) {}
 
 void header::reset(uint8_t version, id cluster) {
     m_cluster = cluster;
     m_version = version;
+    m_flags = 0;
     m_segments.clear();
+    m_segment_times.clear();
+    m_times.marks.clear();
+    end_log();
 }
 
 header::header(id cluster, serializer* stream) : m_cluster(cluster) {
@@ -25,8 +85,14 @@ void header::serialize(serializer* stream) const {
     stream->write((uint8_t*)magic, 2);
     // VERSION
     stream->w(m_version);
+    // FLAGS
+    if (m_version >= 5) stream->w(m_flags);
     // SEGMENTS
-    *stream << m_segments;
+    m_segments.serialize(stream, m_version);
+    // SEGMENT TIMES
+    if (m_version >= 6) m_segment_times.serialize(stream, m_version);
+    // TIME INDEX
+    if (m_version >= 7) m_times.serialize(stream, m_version);
 }
 
 void header::deserialize(serializer* stream) {
@@ -40,12 +106,132 @@ void header::deserialize(serializer* stream) {
     }
     // VERSION
     stream->r(m_version);
+    // FLAGS
+    m_flags = 0;
+    if (m_version >= 5) stream->r(m_flags);
+    end_log();
+    if (m_flags & HEADER_LOG) {
+        m_flags &= ~HEADER_LOG;
+        read_log(stream);
+        return;
+    }
     // SEGMENTS
-    *stream >> m_segments;
+    m_segments.deserialize(stream, m_version);
+    // SEGMENT TIMES
+    if (m_version >= 6) m_segment_times.deserialize(stream, m_version); else m_segment_times.clear();
+    // TIME INDEX
+    if (m_version >= 7) m_times.deserialize(stream, m_version); else m_times.marks.clear();
+}
+
+void header::write_log(serializer* stream) {
+    assert(m_version >= 8 && stream->tell() == 0);
+    // MAGIC
+    char magic[2];
+    magic[0] = 'C'; magic[1] = 'Q';
+    stream->write((uint8_t*)magic, 2);
+    // VERSION
+    stream->w(m_version);
+    // FLAGS
+    uint8_t flags = m_flags | HEADER_LOG;
+    stream->w(flags);
+    // RECORD COUNT
+    m_log_count = 0;
+    stream->w(m_log_count);
+    // RECORDS
+    m_log_end = stream->tell();
+    m_logging = true;
+    m_pending.clear();
+    m_pending_count = 0;
+    for (const auto& kv : m_segments.m) log_segment(kv.first, kv.second);
+    for (const auto& kv : m_segment_times.m) log_segment_time(kv.first, kv.second);
+    for (const auto& m : m_times.marks) log_time(m);
+    append_log(stream);
+}
+
+bool header::append_log(serializer* stream) {
+    assert(m_logging);
+    if (!m_pending_count) return false;
+    // the records go in before the count is updated, so that a log read at any time is whole
+    stream->seek(m_log_end, SEEK_SET);
+    const auto& pending = m_pending.get_chv();
+    stream->write(pending.data(), pending.size());
+    m_log_end += pending.size();
+    m_log_count += m_pending_count;
+    stream->seek(4, SEEK_SET); // magic, version, flags
+    stream->w(m_log_count);
+    m_pending.clear();
+    m_pending_count = 0;
+    return true;
+}
+
+void header::end_log() {
+    m_logging = false;
+    m_pending.clear();
+    m_pending_count = 0;
+    m_log_count = 0;
+    m_log_end = 0;
+}
+
+void header::log_segment(id segment, id position) {
+    m_pending << varint(LOG_SEGMENT);
+    m_pending << varint(segment);
+    m_pending << varint(position);
+    ++m_pending_count;
+}
+
+void header::log_segment_time(id segment, long time) {
+    m_pending << varint(LOG_SEGMENT_TIME);
+    m_pending << varint(segment);
+    m_pending << varint((id)time);
+    ++m_pending_count;
+}
+
+void header::log_time(const time_index::mark& m) {
+    m_pending << varint(LOG_TIME_MARK);
+    m_pending << varint((id)m.time);
+    m_pending << varint((id)(m.time - m.clock));
+    m_pending << varint(m.position);
+    m_pending << varint(m.segment);
+    ++m_pending_count;
+}
+
+void header::read_log(serializer* stream) {
+    uint32_t count;
+    stream->r(count);
+    m_segments.clear();
+    m_segment_times.clear();
+    m_times.marks.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t tag = (uint8_t)varint::load(stream);
+        switch (tag) {
+        case LOG_SEGMENT: {
+            id segment = varint::load(stream);
+            m_segments.m[segment] = varint::load(stream);
+            break;
+        }
+        case LOG_SEGMENT_TIME: {
+            id segment = varint::load(stream);
+            m_segment_times.m[segment] = (long)varint::load(stream);
+            break;
+        }
+        case LOG_TIME_MARK: {
+            time_index::mark m;
+            m.time = (long)varint::load(stream);
+            m.clock = m.time - (long)varint::load(stream);
+            m.position = varint::load(stream);
+            m.segment = varint::load(stream);
+            m_times.marks.push_back(m);
+            break;
+        }
+        default:
+            throw db_error("invalid header log record " + std::to_string(tag));
+        }
+    }
 }
 
 void header::mark_segment(id segment, id position) {
     m_segments.m[segment] = position;
+    if (m_logging) log_segment(segment, position);
 }
 
 id header::get_segment_position(id segment) const {
@@ -60,6 +246,19 @@ size_t header::get_segment_count() const {
     return m_segments.size();
 }
 
+void header::mark_segment_time(id segment, long time) {
+    m_segment_times.m[segment] = time;
+    if (m_logging) log_segment_time(segment, time);
+}
+
+bool header::has_segment_time(id segment) const {
+    return m_segment_times.count(segment) > 0;
+}
+
+long header::get_segment_time(id segment) const {
+    return m_segment_times.at(segment);
+}
+
 id header::get_first_segment() const {
     return m_segments.size() ? m_segments.m.begin()->first : 0;
 }
@@ -80,11 +279,52 @@ id registry::prepare_cluster_for_segment(id segment) {
     return segment / m_cluster_size;
 }
 
+void registry::mark_segment(id segment, id position) {
+    m_forward_index.mark_segment(segment, position);
+    if (m_directory_built) m_directory[segment] = segment_location{m_current_cluster, position};
+}
+
+void registry::build_directory() {
+    m_directory.clear();
+    for (id cluster : m_clusters.m) {
+        const incmap* segments = nullptr;
+        header fi(HEADER_VERSION, cluster + 1);
+        if (cluster == m_current_cluster) {
+            segments = &m_forward_index.get_segments();
+        } else if (file::accessible(cluster_path(cluster + 1))) {
+            file f(cluster_path(cluster + 1), true);
+            f >> fi;
+            segments = &fi.get_segments();
+        }
+        if (!segments) continue;
+        for (const auto& kv : segments->m) m_directory[kv.first] = segment_location{cluster, kv.second};
+    }
+    m_directory_built = true;
+}
+
+bool registry::find_segment(id segment, segment_location& location) {
+    if (!m_directory_built) build_directory();
+    auto it = m_directory.find(segment);
+    if (it != m_directory.end()) {
+        location = it->second;
+        return true;
+    }
+    // the current cluster may have been appended to elsewhere and reread since
+    if (m_current_cluster != nullid && m_forward_index.has_segment(segment)) {
+        location = segment_location{m_current_cluster, m_forward_index.get_segment_position(segment)};
+        m_directory[segment] = location;
+        return true;
+    }
+    return false;
+}
+
 void registry::serialize(serializer* stream) const {
+    // VERSION (a zero cluster size marks a versioned registry; unversioned ones are version 1)
+    *stream << uint32_t(0) << REGISTRY_VERSION;
     // CLUSTER SIZE
     *stream << m_cluster_size;
     // CLUSTERS
-    *stream << m_clusters;
+    m_clusters.serialize(stream, REGISTRY_VERSION);
     // TIP
     id sub = m_cluster_size * (m_clusters.m.size() ? *m_clusters.m.rbegin() : 0);
     assert(m_tip >= sub);
@@ -92,10 +332,19 @@ void registry::serialize(serializer* stream) const {
 }
 
 void registry::deserialize(serializer* stream) {
-    // CLUSTER SIZE
+    // VERSION
+    uint8_t version = 1;
     *stream >> m_cluster_size;
+    if (m_cluster_size == 0) {
+        *stream >> version;
+        if (version > REGISTRY_VERSION) {
+            throw db_error("registry version " + std::to_string(version) + " is not supported (written by a newer version?)");
+        }
+        // CLUSTER SIZE
+        *stream >> m_cluster_size;
+    }
     // CLUSTERS
-    *stream >> m_clusters;
+    m_clusters.deserialize(stream, version);
     // TIP
     id add = m_cluster_size * (m_clusters.m.size() ? *m_clusters.m.rbegin() : 0);
     m_tip = varint::load(stream) + add;
@@ -122,10 +371,10 @@ id registry::cluster_last(bool open_for_writing) {
     return last_cluster;
 }
 
-std::string registry::cluster_path(id cluster) {
+std::string registry::cluster_path(id cluster, const char* suffix) {
     char clu[30];
     sprintf(clu, "%05lld", cluster);
-    return m_dbpath + "/" + m_prefix + clu + ".cq";
+    return m_dbpath + "/" + m_prefix + clu + suffix;
 }
 
 void registry::cluster_will_close(id cluster) {
@@ -141,25 +390,105 @@ void registry::cluster_write_forward_index(id cluster, file* file) {
     assert(cluster == m_current_cluster + 1);
     assert(cluster == m_forward_index.m_cluster);
     *file << m_forward_index;
+    m_forward_index.end_log();
+}
+
+void registry::cluster_log_forward_index(id cluster, file* file) {
+    assert(cluster == m_current_cluster + 1);
+    assert(cluster == m_forward_index.m_cluster);
+    if (m_forward_index.get_version() < 8) {
+        // older headers are rewritten in full
+        file->seek(0, SEEK_SET);
+        *file << m_forward_index;
+    } else if (!m_forward_index.logging() || file->empty()) {
+        file->seek(0, SEEK_SET);
+        m_forward_index.write_log(file);
+    } else {
+        m_forward_index.append_log(file);
+    }
+}
+
+const registry::cached_header* registry::find_header(id cluster) {
+    for (auto& c : m_header_cache) {
+        if (c.cluster == cluster) {
+            c.stamp = ++m_header_clock;
+            return &c;
+        }
+    }
+    return nullptr;
+}
+
+void registry::cache_header(id cluster, const header& hdr, id data_start) {
+    if (m_header_cache_size == 0) return;
+    if (m_header_cache.size() >= m_header_cache_size) {
+        auto lru = m_header_cache.begin();
+        for (auto it = m_header_cache.begin(); it != m_header_cache.end(); ++it) {
+            if (it->stamp < lru->stamp) lru = it;
+        }
+        m_header_cache.erase(lru);
+    }
+    m_header_cache.push_back(cached_header{cluster, hdr, data_start, ++m_header_clock});
+}
+
+void registry::set_header_cache_size(size_t size) {
+    m_header_cache_size = size;
+    if (m_header_cache.size() > size) m_header_cache.clear();
+}
+
+const header* registry::peek_forward_index(id cluster) {
+    // as in cluster_read_forward_index(), keyed by the cluster whose file it is at the start of
+    bool cacheable = sealed(cluster);
+    const cached_header* cached = cacheable ? find_header(cluster + 1) : nullptr;
+    if (cached) return &cached->hdr;
+    std::string path = cluster_path(cluster + 1);
+    if (!file::accessible(path)) return nullptr;
+    file f(path, true);
+    m_peeked.m_cluster = cluster + 1;
+    f >> m_peeked;
+    if (cacheable) cache_header(cluster + 1, m_peeked, f.tell());
+    return &m_peeked;
 }
 
 void registry::cluster_read_forward_index(id cluster, file* file) {
+    // the forward index of (cluster - 1) is final once a later cluster exists
+    bool cacheable = cluster > 0 && sealed(cluster - 1);
+    const cached_header* cached = cacheable ? find_header(cluster) : nullptr;
+    if (cached) {
+        m_forward_index = cached->hdr;
+    } else {
+        m_forward_index.m_cluster = cluster;
+        *file >> m_forward_index;
+        if (cacheable) cache_header(cluster, m_forward_index, file->tell());
+    }
     m_forward_index.m_cluster = cluster;
-    *file >> m_forward_index;
 }
 
 void  registry::cluster_clear_forward_index(id cluster) {
     m_forward_index.reset(HEADER_VERSION, cluster);
+    m_forward_index.set_flags(m_header_flags);
 }
 
 void registry::cluster_read_back_index(id cluster, file* file) {
+    bool cacheable = file->readonly() && sealed(cluster);
+    const cached_header* cached = cacheable ? find_header(cluster) : nullptr;
+    if (cached) {
+        m_back_index = cached->hdr;
+        m_data_start = cached->data_start;
+        file->seek(m_data_start, SEEK_SET);
+    } else {
+        m_back_index.m_cluster = cluster;
+        *file >> m_back_index;
+        m_data_start = file->tell();
+        if (cacheable) cache_header(cluster, m_back_index, m_data_start);
+    }
     m_back_index.m_cluster = m_current_cluster = cluster;
-    *file >> m_back_index;
 }
 
 void registry::cluster_clear_and_write_back_index(id cluster, file* file) {
     m_back_index.reset(HEADER_VERSION, cluster);
+    m_back_index.set_flags(m_header_flags);
     *file << m_back_index;
+    m_data_start = file->tell();
 }
 
 }
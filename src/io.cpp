@@ -3,7 +3,14 @@
 #include <stdexcept>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#   include <immintrin.h>
+#endif
 #include <sys/stat.h>
+#ifndef _WIN32
+#   include <sys/mman.h>
+#endif
+#include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
@@ -19,35 +26,106 @@ uint8_t serializer::get_uint8() {
     throw fs_error(eof() ? "end of file" : "error reading from disk");
 }
 
-void varint::serialize(serializer* stream) const {
-    int nel = (sizeof(id)*8+6)/7;
-    int marker = nel;
-    unsigned char tmp[nel];
-    uint64_t n = m_value;
-    for (;;) {
-        --nel;
-        tmp[nel] = (n & 0x7F) | (marker == nel + 1 ? 0x00 : 0x80);
-        if (n <= 0x7F) break;
-        n = (n >> 7) - 1;
+bool serializer::try_read(uint8_t* data, size_t len) {
+    // fallback for streams without a native implementation
+    try {
+        return read(data, len) == len;
+    } catch (const io_error&) {
+        return false;
     }
-    stream->write(&tmp[nel], marker - nel);
+}
+
+void varint::serialize(serializer* stream) const {
+    encode(*stream, m_value);
 }
 
 void varint::deserialize(serializer* stream) {
-    m_value = 0;
-    while(true) {
-        uint8_t chData = stream->get_uint8();
-        if (m_value > (std::numeric_limits<id>::max() >> 7)) {
-           throw io_error("varint::deserialize(): size too large");
+    m_value = decode(*stream);
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+/**
+ * Zero-extend the 16 bytes in `chunk` into 16 ids at `out`.
+ */
+static inline void widen16(__m128i chunk, id* out) {
+#ifdef __AVX2__
+    _mm256_storeu_si256((__m256i*)&out[0],  _mm256_cvtepu8_epi64(chunk));
+    _mm256_storeu_si256((__m256i*)&out[4],  _mm256_cvtepu8_epi64(_mm_srli_si128(chunk, 4)));
+    _mm256_storeu_si256((__m256i*)&out[8],  _mm256_cvtepu8_epi64(_mm_srli_si128(chunk, 8)));
+    _mm256_storeu_si256((__m256i*)&out[12], _mm256_cvtepu8_epi64(_mm_srli_si128(chunk, 12)));
+#else
+    const __m128i z = _mm_setzero_si128();
+    const __m128i w16[2] = { _mm_unpacklo_epi8(chunk, z), _mm_unpackhi_epi8(chunk, z) };
+    for (int i = 0; i < 2; ++i) {
+        const __m128i w32[2] = { _mm_unpacklo_epi16(w16[i], z), _mm_unpackhi_epi16(w16[i], z) };
+        for (int j = 0; j < 2; ++j) {
+            _mm_storeu_si128((__m128i*)&out[i * 8 + j * 4],     _mm_unpacklo_epi32(w32[j], z));
+            _mm_storeu_si128((__m128i*)&out[i * 8 + j * 4 + 2], _mm_unpackhi_epi32(w32[j], z));
         }
-        m_value = (m_value << 7) | (chData & 0x7F);
-        if (chData & 0x80) {
-            if (m_value == std::numeric_limits<id>::max()) {
-                throw io_error("varint::deserialize(): size too large");
-            }
-            m_value++;
-        } else return;
     }
+#endif
+}
+#define CQ_VARINT_SIMD
+#endif
+
+size_t varint::encode_many(const id* values, size_t count, uint8_t* out) {
+    uint8_t* p = out;
+    size_t i = 0;
+    while (i < count) {
+        // runs of values below 0x80 are written as is, 8 at a time
+        if (count - i >= 8 && (values[i] | values[i + 1] | values[i + 2] | values[i + 3] | values[i + 4] | values[i + 5] | values[i + 6] | values[i + 7]) < 0x80) {
+            for (size_t j = 0; j < 8; ++j) p[j] = (uint8_t)values[i + j];
+            p += 8;
+            i += 8;
+            continue;
+        }
+        p += encode(values[i++], p);
+    }
+    return p - out;
+}
+
+size_t varint::decode_many(const uint8_t* data, size_t len, id* values, size_t& count) {
+    size_t pos = 0, n = 0;
+    while (n < count && pos < len) {
+#ifdef CQ_VARINT_SIMD
+        if (count - n >= 16 && len - pos >= 16) {
+            // bytes without the continuation bit, up to the first one with it, are complete varints
+            __m128i chunk = _mm_loadu_si128((const __m128i*)&data[pos]);
+            unsigned mask = _mm_movemask_epi8(chunk);
+            widen16(chunk, &values[n]);
+            size_t run = mask ? __builtin_ctz(mask) : 16;
+            n += run;
+            pos += run;
+            if (run == 16) continue;
+        }
+#endif
+        id value = 0;
+        size_t i = pos;
+        while (i < len && !step(value, data[i])) ++i;
+        if (i == len) break;
+        values[n++] = value;
+        pos = i + 1;
+    }
+    count = n;
+    return pos;
+}
+
+bool varint::try_load(serializer* stream, id& value) {
+    size_t avail;
+    const uint8_t* p = stream->view(avail);
+    value = 0;
+    for (size_t i = 0; i < avail; ++i) {
+        if (step(value, p[i])) {
+            stream->skip(i + 1);
+            return true;
+        }
+    }
+    value = 0;
+    uint8_t chData;
+    do {
+        if (!stream->try_get_uint8(chData)) return false;
+    } while (!step(value, chData));
+    return true;
 }
 
 // void varint::serialize(serializer* stream) const {
@@ -92,38 +170,147 @@ void varint::deserialize(serializer* stream) {
 //     }
 // }
 
+// bitpacking
+
+/**
+ * Append the low `bits` (at most 56) bits of `x` to the bit accumulator, flushing whole bytes.
+ */
+static inline void bitpack_push(uint8_t*& p, uint64_t& acc, unsigned& fill, id x, unsigned bits) {
+    acc |= x << fill;
+    fill += bits;
+    while (fill >= 8) {
+        *p++ = (uint8_t)acc;
+        acc >>= 8;
+        fill -= 8;
+    }
+}
+
+static inline id bitpack_pull(const uint8_t*& p, uint64_t& acc, unsigned& fill, unsigned bits) {
+    while (fill < bits) {
+        acc |= (uint64_t)*p++ << fill;
+        fill += 8;
+    }
+    id x = acc & ((uint64_t(1) << bits) - 1);
+    acc >>= bits;
+    fill -= bits;
+    return x;
+}
+
+void bitpacked::encode(serializer* stream, const id* values, size_t count) {
+    uint8_t buf[1 + BLOCK * 8];
+    while (count >= MIN_TAIL) {
+        size_t n = count < BLOCK ? count : BLOCK;
+        id all = 0;
+        for (size_t i = 0; i < n; ++i) all |= values[i];
+        uint8_t width = 0;
+        while (width < 64 && (all >> width)) ++width;
+        uint8_t* p = buf;
+        *p++ = width;
+        uint64_t acc = 0;
+        unsigned fill = 0;
+        if (width > 56) {
+            for (size_t i = 0; i < n; ++i) {
+                bitpack_push(p, acc, fill, values[i] & 0xffffffff, 32);
+                bitpack_push(p, acc, fill, values[i] >> 32, width - 32);
+            }
+        } else if (width) {
+            for (size_t i = 0; i < n; ++i) bitpack_push(p, acc, fill, values[i], width);
+        }
+        if (fill) *p++ = (uint8_t)acc;
+        stream->write(buf, p - buf);
+        values += n;
+        count -= n;
+    }
+    if (count) varint::encode_many(*stream, values, count);
+}
+
+void bitpacked::decode(serializer* stream, id* values, size_t count) {
+    uint8_t buf[BLOCK * 8];
+    while (count >= MIN_TAIL) {
+        size_t n = count < BLOCK ? count : BLOCK;
+        uint8_t width = stream->get_uint8();
+        if (width > 64) throw io_error("bitpacked::decode(): invalid width");
+        size_t bytes = (n * width + 7) >> 3;
+        size_t avail;
+        const uint8_t* data = stream->view(avail);
+        if (avail < bytes) {
+            stream->read(buf, bytes);
+            data = buf;
+        }
+        const uint8_t* p = data;
+        uint64_t acc = 0;
+        unsigned fill = 0;
+        if (width > 56) {
+            for (size_t i = 0; i < n; ++i) {
+                id lo = bitpack_pull(p, acc, fill, 32);
+                values[i] = lo | (bitpack_pull(p, acc, fill, width - 32) << 32);
+            }
+        } else if (width) {
+            for (size_t i = 0; i < n; ++i) values[i] = bitpack_pull(p, acc, fill, width);
+        } else {
+            memset(values, 0, n * sizeof(id));
+        }
+        if (data != buf) stream->skip(bytes);
+        values += n;
+        count -= n;
+    }
+    if (count) varint::decode_many(*stream, values, count);
+}
+
+// incmap
+
 void incmap::serialize(serializer* stream) const {
+    serialize(stream, 1);
+}
+
+void incmap::deserialize(serializer* stream) {
+    deserialize(stream, 1);
+}
+
+void incmap::serialize(serializer* stream, uint8_t version) const {
     // VARINT : number of entries
     *stream << varint((id)(m.size()));
-    // serialize as varints equal to the diff with the previous element
-    // TODO: use binomial encoding or something
-    varint v;
-    id lv = 0;
-    for (const auto& kv : m) {
-        assert(kv.first >= lv);
-        v.m_value = kv.first - lv;
-        lv = kv.first;
-        *stream << v;
-    }
-    lv = 0;
+    // serialize as deltas from the previous element, keys first
+    size_t size = m.size();
+    std::vector<id> deltas(size << 1);
+    id lk = 0, lv = 0;
+    size_t i = 0;
     for (const auto& kv : m) {
+        assert(kv.first >= lk);
         assert(kv.second >= lv);
-        v.m_value = kv.second - lv;
+        deltas[i] = kv.first - lk;
+        deltas[size + i] = kv.second - lv;
+        lk = kv.first;
         lv = kv.second;
-        *stream << v;
+        ++i;
+    }
+    if (version < 2) {
+        varint::encode_many(*stream, deltas.data(), deltas.size());
+    } else {
+        // keys and values are packed separately, as their deltas tend to differ a lot in size
+        bitpacked::encode(stream, deltas.data(), size);
+        bitpacked::encode(stream, deltas.data() + size, size);
     }
 }
 
-void incmap::deserialize(serializer* stream) {
+void incmap::deserialize(serializer* stream, uint8_t version) {
     // VARINT : number of entries
     id size = varint::load(stream);
-    // deserialize as varints equal to the diff with the previous element
-    // TODO: use binomial encoding or something
-    std::vector<id> k;
-    k.resize(size);
+    // deserialize as deltas from the previous element
+    std::vector<id> deltas(size << 1);
+    if (version < 2) {
+        varint::decode_many(*stream, deltas.data(), deltas.size());
+    } else {
+        bitpacked::decode(stream, deltas.data(), size);
+        bitpacked::decode(stream, deltas.data() + size, size);
+    }
     m.clear();
-    id lv = 0; for (id i = 0; i < size; ++i) { lv += varint::load(stream); k[i] = lv; }
-    lv = 0;    for (id i = 0; i < size; ++i) { lv += varint::load(stream); m[k[i]] = lv; }
+    id lk = 0, lv = 0;
+    for (id i = 0; i < size; ++i) {
+        lk += deltas[i];
+        lv += deltas[size + i];
+        m.emplace_hint(m.end(), lk, lv);
+    }
 }
 
 bool incmap::operator==(const incmap& other) const {
@@ -137,43 +324,77 @@ bool incmap::operator==(const incmap& other) const {
 }
 
 void unordered_set::serialize(serializer* stream) const {
+    serialize(stream, 1);
+}
+
+void unordered_set::deserialize(serializer* stream) {
+    deserialize(stream, 1);
+}
+
+void unordered_set::serialize(serializer* stream, uint8_t version) const {
     // VARINT : number of entries
     *stream << varint((id)(m.size()));
-    // serialize as varints equal to the diff with the previous element
-    // TODO: use binomial encoding or something
-    varint v;
+    // serialize as deltas from the previous element
+    std::vector<id> deltas;
+    deltas.reserve(m.size());
     id lv = 0;
     for (const auto& k : m) {
         assert(k >= lv);
-        v.m_value = k - lv;
+        deltas.push_back(k - lv);
         lv = k;
-        *stream << v;
+    }
+    if (version < 2) {
+        varint::encode_many(*stream, deltas.data(), deltas.size());
+    } else {
+        bitpacked::encode(stream, deltas.data(), deltas.size());
     }
 }
 
-void unordered_set::deserialize(serializer* stream) {
+void unordered_set::deserialize(serializer* stream, uint8_t version) {
     // VARINT : number of entries
     id size = varint::load(stream);
-    // deserialize as varints equal to the diff with the previous element
-    // TODO: use binomial encoding or something
+    // deserialize as deltas from the previous element
+    std::vector<id> deltas(size);
+    if (version < 2) {
+        varint::decode_many(*stream, deltas.data(), deltas.size());
+    } else {
+        bitpacked::decode(stream, deltas.data(), deltas.size());
+    }
     m.clear();
-    id lv = 0; for (id i = 0; i < size; ++i) { lv += varint::load(stream); m.insert(lv); }
+    id lv = 0;
+    for (id d : deltas) {
+        lv += d;
+        m.emplace_hint(m.end(), lv);
+    }
 }
 
 // file stream
 
-file::file(FILE* fp) : m_tell(0), m_fp(fp) {}
+static long stdio_size(FILE* fp) {
+    long pos = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, pos, SEEK_SET);
+    return size;
+}
+
+file::file(FILE* fp) : m_tell(0), m_readonly(false), m_fp(fp), m_fpos(-1), m_writing(false) {
+    m_size = stdio_size(m_fp);
+}
 
 file::file(const std::string& fname, bool readonly, bool clear) {
     m_path = fname;
     m_readonly = readonly;
     m_tell = 0;
     m_fp = nullptr;
+    m_fpos = 0;
+    m_writing = false;
     if (!clear || readonly) {
         m_fp = fopen(m_path.c_str(), readonly ? "rb" : "rb+");
     }
     if (!m_fp && !readonly) m_fp = fopen(m_path.c_str(), "wb+");
     if (!m_fp) throw fs_error("cannot open file " + m_path);
+    m_size = stdio_size(m_fp);
 }
 
 bool file::accessible(const std::string& fname) {
@@ -192,45 +413,546 @@ file::~file() {
     }
 }
 
-bool file::eof() {
-    uint8_t byte;
-    size_t s = fread(&byte, 1, 1, m_fp);
-    if (s == 0) return true;
-    fseek(m_fp, -1, SEEK_CUR);
-    return false;
+void file::sync(bool writing) {
+    if (m_fpos != m_tell || m_writing != writing) {
+        fseek(m_fp, m_tell, SEEK_SET);
+        m_fpos = m_tell;
+        m_writing = writing;
+    }
 }
 
 size_t file::write(const uint8_t* data, size_t len) {
     assert(!m_readonly);
+    sync(true);
     size_t w = fwrite(data, 1, len, m_fp);
-    if (w != len) throw io_error("write error");
+    if (w != len) {
+        m_fpos = -1;
+        throw io_error("write error");
+    }
     m_tell += w;
+    m_fpos = m_tell;
+    if (m_tell > m_size) m_size = m_tell;
     return w;
 }
 
+bool file::try_read(uint8_t* data, size_t len) noexcept {
+    if (m_tell + (long)len > m_size) return false;
+    sync(false);
+    size_t r = fread(data, 1, len, m_fp);
+    if (r != len) {
+        // the stream is put back where we think it is before the next read or write
+        m_fpos = -1;
+        return false;
+    }
+    m_tell += r;
+    m_fpos = m_tell;
+    return true;
+}
+
 size_t file::read(uint8_t* data, size_t len) {
+    sync(false);
     size_t r = fread(data, 1, len, m_fp);
-    if (r != len) throw io_error("end of file");
+    if (r != len) {
+        m_fpos = -1;
+        throw io_error("end of file");
+    }
     m_tell += r;
+    m_fpos = m_tell;
     return r;
 }
 
+void file::position(long offset, int whence) {
+    long target = whence == SEEK_SET ? offset : whence == SEEK_CUR ? m_tell + offset : m_size + offset;
+    // we do not let the position go past the edges
+    m_tell = target < 0 ? 0 : target > m_size ? m_size : target;
+}
+
 void file::seek(long offset, int whence) {
-    fseek(m_fp, offset, whence);
-    // force "fix" in case we went over the edge
-    uint8_t b;
-    size_t s = fread(&b, 1, 1, m_fp);
-    if (s == 1) fseek(m_fp, -1, SEEK_CUR); else fseek(m_fp, 0, SEEK_END);
-    m_tell = ftell(m_fp);
+    position(offset, whence);
 }
 
 long file::tell() { return m_tell; }
 
 void file::reopen() {
-    m_tell = ftell(m_fp);
     fclose(m_fp);
     m_fp = fopen(m_path.c_str(), m_readonly ? "rb" : "rb+");
-    fseek(m_fp, m_tell, SEEK_SET);
+    if (!m_fp) throw fs_error("cannot reopen file " + m_path);
+    m_size = stdio_size(m_fp);
+    if (m_tell > m_size) m_tell = m_size;
+    m_fpos = 0;
+    m_writing = false;
+}
+
+#ifndef _WIN32
+
+// posix file stream
+
+posix_file::posix_file(const std::string& fname, bool readonly, bool clear, size_t buffer_size)
+:   m_wlen(0)
+,   m_wpos(0)
+,   m_rlen(0)
+,   m_rpos(0)
+{
+    m_path = fname;
+    m_readonly = readonly;
+    m_fd = -1;
+    if (!clear || readonly) {
+        m_fd = ::open(m_path.c_str(), readonly ? O_RDONLY : O_RDWR);
+    }
+    if (m_fd == -1 && !readonly) m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (m_fd == -1) throw fs_error("cannot open file " + m_path);
+    struct stat st;
+    if (fstat(m_fd, &st)) {
+        ::close(m_fd);
+        throw fs_error("cannot stat file " + m_path);
+    }
+    m_size = st.st_size;
+    if (!readonly) m_wbuf.resize(buffer_size);
+    m_rbuf.resize(buffer_size);
+}
+
+posix_file::~posix_file() {
+    try {
+        flush_writes();
+    } catch (io_error& err) {
+        fprintf(stderr, "*** %s: %s\n", m_path.c_str(), err.what());
+    }
+    ::close(m_fd);
+}
+
+void posix_file::write_out(const uint8_t* data, size_t len, long pos) {
+    while (len) {
+        ssize_t w = pwrite(m_fd, data, len, pos);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) throw io_error("write error");
+        data += w;
+        len -= w;
+        pos += w;
+    }
+}
+
+void posix_file::flush_writes() {
+    if (!m_wlen) return;
+    size_t len = m_wlen;
+    m_wlen = 0;
+    write_out(m_wbuf.data(), len, m_wpos);
+}
+
+size_t posix_file::write_slow(const uint8_t* data, size_t len) {
+    assert(!m_readonly);
+    // drop read-ahead data that this write overlaps
+    if (m_rlen && m_tell < m_rpos + (long)m_rlen && m_tell + (long)len > m_rpos) m_rlen = 0;
+    if (m_wlen && (m_wpos + (long)m_wlen != m_tell || m_wlen + len > m_wbuf.size())) flush_writes();
+    if (len >= m_wbuf.size()) {
+        write_out(data, len, m_tell);
+    } else {
+        if (!m_wlen) m_wpos = m_tell;
+        memcpy(&m_wbuf[m_wlen], data, len);
+        m_wlen += len;
+    }
+    m_tell += len;
+    if (m_tell > m_size) m_size = m_tell;
+    return len;
+}
+
+bool posix_file::try_read_slow(uint8_t* data, size_t len) noexcept {
+    if (m_tell + (long)len > m_size) return false;
+    // pending writes must hit the disk before we can read them back
+    try {
+        flush_writes();
+    } catch (const io_error&) {
+        return false;
+    }
+    long pos = m_tell;
+    size_t remaining = len;
+    while (remaining) {
+        if (pos >= m_rpos && pos < m_rpos + (long)m_rlen) {
+            size_t offset = pos - m_rpos;
+            size_t avail = m_rlen - offset;
+            if (avail > remaining) avail = remaining;
+            memcpy(data, &m_rbuf[offset], avail);
+            data += avail;
+            pos += avail;
+            remaining -= avail;
+            continue;
+        }
+        ssize_t r;
+        if (remaining >= m_rbuf.size()) {
+            // big reads bypass the buffer
+            r = pread(m_fd, data, remaining, pos);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            data += r;
+            pos += r;
+            remaining -= r;
+            continue;
+        }
+        r = pread(m_fd, m_rbuf.data(), m_rbuf.size(), pos);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            m_rlen = 0;
+            return false;
+        }
+        // the file may have grown since we learned its size; the rest is not ours to see yet
+        if (r > m_size - pos) r = m_size - pos;
+        m_rpos = pos;
+        m_rlen = r;
+    }
+    m_tell = pos;
+    return true;
+}
+
+const uint8_t* posix_file::view_slow(size_t& avail) {
+    flush_writes();
+    if (m_tell >= m_size) {
+        avail = 0;
+        return nullptr;
+    }
+    if (m_tell < m_rpos || m_tell >= m_rpos + (long)m_rlen) {
+        ssize_t r;
+        do {
+            r = pread(m_fd, m_rbuf.data(), m_rbuf.size(), m_tell);
+        } while (r < 0 && errno == EINTR);
+        if (r > m_size - m_tell) r = m_size - m_tell;
+        m_rpos = m_tell;
+        m_rlen = r > 0 ? r : 0;
+        if (!m_rlen) {
+            avail = 0;
+            return nullptr;
+        }
+    }
+    size_t offset = m_tell - m_rpos;
+    avail = m_rlen - offset;
+    return &m_rbuf[offset];
+}
+
+void posix_file::reopen() {
+    flush_writes();
+    m_rlen = 0;
+    struct stat st;
+    if (fstat(m_fd, &st)) throw fs_error("cannot stat file " + m_path);
+    m_size = st.st_size;
+}
+
+// memory mapped file stream
+
+mmap_file::mmap_file(const std::string& fname) : m_map(nullptr) {
+    m_path = fname;
+    m_readonly = true;
+    m_fd = ::open(m_path.c_str(), O_RDONLY);
+    if (m_fd == -1) throw fs_error("cannot open file " + m_path);
+    try {
+        map();
+    } catch (const fs_error&) {
+        ::close(m_fd);
+        throw;
+    }
+}
+
+mmap_file::~mmap_file() {
+    unmap();
+    ::close(m_fd);
+}
+
+void mmap_file::map() {
+    struct stat st;
+    if (fstat(m_fd, &st)) throw fs_error("cannot stat file " + m_path);
+    m_size = st.st_size;
+    if (m_size == 0) return; // zero length mappings are not allowed
+    void* map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) throw fs_error("cannot map file " + m_path);
+    m_map = (const uint8_t*)map;
+    madvise(map, m_size, MADV_SEQUENTIAL);
+}
+
+void mmap_file::unmap() {
+    if (m_map) munmap((void*)m_map, m_size);
+    m_map = nullptr;
+    m_size = 0;
+}
+
+void mmap_file::reopen() {
+    unmap();
+    map();
+    if (m_tell > m_size) m_tell = m_size;
+}
+
+// ring file
+
+ring_file::ring_file(const std::string& fname, bool clear, size_t ring_size)
+:   m_origin(0)
+,   m_head(0)
+,   m_tail(0)
+,   m_idle(false)
+,   m_waiting(false)
+,   m_stop(false)
+,   m_failed(false)
+,   m_rlen(0)
+,   m_rpos(0)
+{
+    m_path = fname;
+    m_readonly = false;
+    m_fd = -1;
+    if (!clear) m_fd = ::open(m_path.c_str(), O_RDWR);
+    if (m_fd == -1) m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (m_fd == -1) throw fs_error("cannot open file " + m_path);
+    struct stat st;
+    if (fstat(m_fd, &st)) {
+        ::close(m_fd);
+        throw fs_error("cannot stat file " + m_path);
+    }
+    m_size = st.st_size;
+    size_t size = 1;
+    while (size < ring_size) size <<= 1;
+    m_ring.resize(size);
+    m_mask = size - 1;
+    m_rbuf.resize(posix_file::BUFFER_SIZE);
+    m_thread = std::thread(&ring_file::run, this);
+}
+
+ring_file::~ring_file() {
+    try {
+        drain();
+    } catch (io_error& err) {
+        fprintf(stderr, "*** %s: %s\n", m_path.c_str(), err.what());
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+    ::close(m_fd);
+}
+
+void ring_file::run() {
+    for (;;) {
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        if (head == tail) {
+            // announce going to sleep before checking once more, so that the writer either sees
+            // us idle and wakes us (clearing m_idle), or we see its data
+            m_idle.store(true);
+            if (m_head.load() == tail) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return !m_idle.load() || m_stop.load(); });
+                if (m_stop) return;
+            }
+            m_idle.store(false);
+            continue;
+        }
+        size_t offset = tail & m_mask;
+        size_t len = head - tail;
+        if (len > m_ring.size() - offset) len = m_ring.size() - offset;
+        if (!m_failed) {
+            try {
+                write_out(&m_ring[offset], len, m_origin + (long)tail);
+            } catch (const io_error&) {
+                m_failed = true;
+            }
+        }
+        // sequentially consistent, as is await_tail()'s announcing it waits, so that either this
+        // sees the writer waiting, or the writer sees the new tail
+        m_tail.store(tail + len);
+        if (m_waiting.load()) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_caught_up.notify_one();
+        }
+    }
+}
+
+void ring_file::wake() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_wake.notify_one();
+}
+
+void ring_file::await_tail(uint64_t tail) {
+    if (m_tail.load(std::memory_order_acquire) >= tail) return;
+    // the I/O thread is not idle while there is data in the ring, so it will get here
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_waiting.store(true);
+    m_caught_up.wait(lock, [this, tail] { return m_tail.load() >= tail; });
+    m_waiting.store(false);
+}
+
+void ring_file::drain() {
+    await_tail(m_head.load(std::memory_order_relaxed));
+    if (m_failed) throw io_error("write error");
+}
+
+void ring_file::write_out(const uint8_t* data, size_t len, long pos) {
+    while (len) {
+        ssize_t w = pwrite(m_fd, data, len, pos);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) throw io_error("write error");
+        data += w;
+        len -= w;
+        pos += w;
+    }
+}
+
+size_t ring_file::write_slow(const uint8_t* data, size_t len) {
+    // the write may overlap the read buffer
+    m_rpos = 0;
+    m_rlen = 0;
+    if (len <= m_ring.size() && m_tell == m_origin + (long)m_head.load(std::memory_order_relaxed)) {
+        // appending, but the ring is full: wait for the I/O thread to make room
+        await_tail(m_head.load(std::memory_order_relaxed) + len - m_ring.size());
+        if (m_failed) throw io_error("write error");
+        return write(data, len);
+    }
+    // writing elsewhere, or more than fits: done directly, after which appends continue from here
+    drain();
+    write_out(data, len, m_tell);
+    m_tell += len;
+    if (m_tell > m_size) m_size = m_tell;
+    m_origin = m_tell - (long)m_head.load(std::memory_order_relaxed);
+    return len;
+}
+
+bool ring_file::try_read_slow(uint8_t* data, size_t len) noexcept {
+    if (m_tell + (long)len > m_size) return false;
+    // what is in the ring must hit the disk before we can read it back
+    try {
+        drain();
+    } catch (const io_error&) {
+        return false;
+    }
+    long pos = m_tell;
+    size_t remaining = len;
+    while (remaining) {
+        if (pos >= m_rpos && pos < m_rpos + (long)m_rlen) {
+            size_t offset = pos - m_rpos;
+            size_t avail = m_rlen - offset;
+            if (avail > remaining) avail = remaining;
+            memcpy(data, &m_rbuf[offset], avail);
+            data += avail;
+            pos += avail;
+            remaining -= avail;
+            continue;
+        }
+        ssize_t r;
+        if (remaining >= m_rbuf.size()) {
+            // big reads bypass the buffer
+            r = pread(m_fd, data, remaining, pos);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            data += r;
+            pos += r;
+            remaining -= r;
+            continue;
+        }
+        r = pread(m_fd, m_rbuf.data(), m_rbuf.size(), pos);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            m_rlen = 0;
+            return false;
+        }
+        if (r > m_size - pos) r = m_size - pos;
+        m_rpos = pos;
+        m_rlen = r;
+    }
+    m_tell = pos;
+    return true;
+}
+
+const uint8_t* ring_file::view_slow(size_t& avail) {
+    drain();
+    if (m_tell >= m_size) {
+        avail = 0;
+        return nullptr;
+    }
+    if (m_tell < m_rpos || m_tell >= m_rpos + (long)m_rlen) {
+        ssize_t r;
+        do {
+            r = pread(m_fd, m_rbuf.data(), m_rbuf.size(), m_tell);
+        } while (r < 0 && errno == EINTR);
+        if (r > m_size - m_tell) r = m_size - m_tell;
+        m_rpos = m_tell;
+        m_rlen = r > 0 ? r : 0;
+        if (!m_rlen) {
+            avail = 0;
+            return nullptr;
+        }
+    }
+    size_t offset = m_tell - m_rpos;
+    avail = m_rlen - offset;
+    return &m_rbuf[offset];
+}
+
+void ring_file::flush() {
+    drain();
+    if (fsync(m_fd)) throw io_error("fsync failed");
+}
+
+void ring_file::reopen() {
+    drain();
+    m_rlen = 0;
+    struct stat st;
+    if (fstat(m_fd, &st)) throw fs_error("cannot stat file " + m_path);
+    m_size = st.st_size;
+    if (m_tell > m_size) m_tell = m_size;
+}
+
+#endif // _WIN32
+
+file* open_file(const std::string& path, bool readonly, bool clear, uint8_t backend) {
+#ifndef _WIN32
+    if (!readonly && (backend & ring_backend)) return new ring_file(path, clear);
+    if (readonly && (backend & mmap_backend)) return new mmap_file(path);
+    if (backend & posix_backend) return new posix_file(path, readonly, clear);
+#endif
+    return new file(path, readonly, clear);
+}
+
+// file cache
+
+file* file_cache::acquire(const std::string& path, uint8_t backend) {
+    for (auto& e : m_entries) {
+        if (!e.in_use && e.backend == backend && e.path == path) {
+            ++m_hits;
+            e.in_use = true;
+            e.f->seek(0, SEEK_SET);
+            return e.f;
+        }
+    }
+    ++m_misses;
+    file* f = open_file(path, true, false, backend);
+    if (m_budget == 0) return f;
+    m_entries.push_back(entry{path, backend, f, true, 0});
+    evict();
+    return f;
+}
+
+void file_cache::release(file* f) {
+    for (auto& e : m_entries) {
+        if (e.f == f) {
+            e.in_use = false;
+            e.stamp = ++m_clock;
+            evict();
+            return;
+        }
+    }
+    delete f;
+}
+
+void file_cache::evict() {
+    while (m_entries.size() > m_budget) {
+        size_t lru = m_entries.size();
+        for (size_t i = 0; i < m_entries.size(); ++i) {
+            if (!m_entries[i].in_use && (lru == m_entries.size() || m_entries[i].stamp < m_entries[lru].stamp)) lru = i;
+        }
+        if (lru == m_entries.size()) return; // everything is in use
+        delete m_entries[lru].f;
+        m_entries.erase(m_entries.begin() + lru);
+    }
+}
+
+void file_cache::clear() {
+    size_t budget = m_budget;
+    m_budget = 0;
+    evict();
+    m_budget = budget;
 }
 
 // char vector stream
@@ -243,6 +965,13 @@ size_t chv_stream::write(const uint8_t* data, size_t len) {
     return len;
 }
 
+bool chv_stream::try_read(uint8_t* data, size_t len) noexcept {
+    if (m_tell + len > m_chv.size()) return false;
+    memcpy(data, &m_chv.data()[m_tell], len);
+    m_tell += len;
+    return true;
+}
+
 size_t chv_stream::read(uint8_t* data, size_t len)        {
     size_t r = m_chv.size() - m_tell;
     if (r > len) r = len;
@@ -259,11 +988,26 @@ void chv_stream::seek(long offset, int whence) {
     if (m_tell > m_chv.size()) m_tell = m_chv.size();
 }
 long chv_stream::tell() { return m_tell; }
+const uint8_t* chv_stream::view(size_t& avail) {
+    avail = m_chv.size() - m_tell;
+    return avail ? &m_chv.data()[m_tell] : nullptr;
+}
 
 // cluster stream
 
-cluster::cluster(cluster_delegate* delegate, bool readonly) : m_delegate(delegate), m_file(nullptr), m_readonly(readonly) {}
-cluster::~cluster()                                     { if (m_file) delete m_file; }
+cluster::cluster(cluster_delegate* delegate, bool readonly, uint8_t backend) : m_file(nullptr), m_delegate(delegate), m_readonly(readonly), m_backend(backend), m_cache(nullptr) {}
+cluster::~cluster()                                     { if (m_file) close_file(m_file); }
+
+file* cluster::open_cluster_file(id cluster, bool readonly, bool clear) {
+    if (m_cache && readonly && !clear && m_delegate->cluster_next(cluster) != nullid) {
+        return m_cache->acquire(m_delegate->cluster_path(cluster), m_backend);
+    }
+    return open_file(m_delegate->cluster_path(cluster), readonly, clear, m_backend);
+}
+
+void cluster::close_file(file* f) {
+    if (m_cache) m_cache->release(f); else delete f;
+}
 size_t cluster::write(const uint8_t* data, size_t len)  { return m_file->write(data, len); }
 void cluster::seek(long offset, int whence)             { m_file->seek(offset, whence); }
 long cluster::tell()                                    { return m_file->tell(); }
@@ -274,8 +1018,8 @@ void cluster::open(id cluster, bool readonly, bool clear) {
     bool require_readonly = !clear && (m_cluster != nullid && cluster < m_cluster);
     if (require_readonly && !readonly) throw io_error("readonly mode required when opening target cluster (non-sequential operation requested)");
     m_cluster = cluster;
-    if (m_file) delete m_file;
-    m_file = new file(m_delegate->cluster_path(m_cluster), readonly, clear);
+    if (m_file) close_file(m_file);
+    m_file = open_cluster_file(m_cluster, readonly, clear);
     m_delegate->cluster_opened(m_cluster, m_file);
 }
 
@@ -291,16 +1035,19 @@ bool cluster::eof() {
     return !m_file || m_file->eof();
 }
 
-size_t cluster::read(uint8_t* data, size_t len) {
+bool cluster::try_read(uint8_t* data, size_t len) {
     for (;;) {
-        try {
-            return m_file->read(data, len);
-        } catch (io_error& err) {
-            if (eof()) throw err;
-        }
+        if (m_file && m_file->try_read(data, len)) return true;
+        // if we are at the end of the current file, eof() moves us on to the next cluster, if any
+        if (!m_file || !m_file->eof() || eof()) return false;
     }
 }
 
+size_t cluster::read(uint8_t* data, size_t len) {
+    if (!try_read(data, len)) throw io_error("end of file");
+    return len;
+}
+
 void cluster::resume(bool clear) {
     open(m_delegate->cluster_last(!m_readonly), m_readonly, clear);
 }
@@ -311,7 +1058,12 @@ void indexed_cluster::close() {
     if (m_cluster != nullid) {
         m_delegate->cluster_will_close(m_cluster);
         if (!m_file->readonly()) {
-            file forward_index(m_delegate->cluster_path(m_cluster + 1), false);
+            if (m_index_file) {
+                delete m_index_file;
+                m_index_file = nullptr;
+            }
+            // the index is written anew, replacing whatever flush() left
+            file forward_index(m_delegate->cluster_path(m_cluster + 1), false, true);
             m_delegate->cluster_write_forward_index(m_cluster + 1, &forward_index);
         }
     }
@@ -320,8 +1072,9 @@ void indexed_cluster::close() {
 void indexed_cluster::flush() {
     cluster::flush();
     if (m_cluster != nullid && !m_file->readonly()) {
-        file forward_index(m_delegate->cluster_path(m_cluster + 1), false);
-        m_delegate->cluster_write_forward_index(m_cluster + 1, &forward_index);
+        if (!m_index_file) m_index_file = new file(m_delegate->cluster_path(m_cluster + 1), false, true);
+        m_delegate->cluster_log_forward_index(m_cluster + 1, m_index_file);
+        m_index_file->flush();
     }
 }
 
@@ -332,11 +1085,17 @@ void indexed_cluster::open(id cluster, bool readonly, bool clear) {
     // 0. If readwrite open, write forward index (aka "close").
     close();
 
-    if (m_file) delete m_file;
+    if (m_file) close_file(m_file);
+    m_file = nullptr;
 
     if (readonly) {
-        // 1. Read forward index. Open and read from cluster (x+1).
-        if (file::accessible(m_delegate->cluster_path(cluster + 1))) {
+        // 1. Read forward index. Open and read from cluster (x+1). Its file may come from the
+        //    cache only once a cluster after x+1 exists, as until then x+1 may still grow.
+        if (m_cache && m_delegate->cluster_next(cluster + 1) != nullid) {
+            file* forward_index = m_cache->acquire(m_delegate->cluster_path(cluster + 1), m_backend);
+            m_delegate->cluster_read_forward_index(cluster + 1, forward_index);
+            m_cache->release(forward_index);
+        } else if (file::accessible(m_delegate->cluster_path(cluster + 1))) {
             file forward_index(m_delegate->cluster_path(cluster + 1), true);
             m_delegate->cluster_read_forward_index(cluster + 1, &forward_index);
         } else {
@@ -344,7 +1103,7 @@ void indexed_cluster::open(id cluster, bool readonly, bool clear) {
         }
         // 2. Open cluster x. Read back index.
         m_cluster = cluster;
-        m_file = new file(m_delegate->cluster_path(m_cluster), true);
+        m_file = open_cluster_file(m_cluster, true);
         m_delegate->cluster_read_back_index(m_cluster, m_file);
         m_delegate->cluster_opened(m_cluster,  m_file);
         return;
@@ -362,7 +1121,7 @@ void indexed_cluster::open(id cluster, bool readonly, bool clear) {
 
 	// 2. Read back index from cluster x if found.
     m_cluster = cluster;
-    m_file = new file(m_delegate->cluster_path(m_cluster), false);
+    m_file = open_file(m_delegate->cluster_path(m_cluster), false, false, m_backend);
     if (!m_file->eof()) {
         m_delegate->cluster_read_back_index(m_cluster, m_file);
         m_delegate->cluster_opened(m_cluster, m_file);
@@ -8,6 +8,11 @@
 
 BITCOIN_SER(uint256);
 
+namespace cq {
+// object hashes are random already
+template<> struct hasher<uint256> : public prehashed<uint256> {};
+}
+
 static inline cq::conditional* get_varint(uint8_t b, cq::id value) {
     switch (b) {
         case 1: return new cq::cond_varint<1>(value);
@@ -36,6 +41,32 @@ struct test_object : public cq::object<uint256> {
     }
 };
 
+struct test_intrusive_object : public test_object, public cq::refcounted {
+    using test_object::test_object;
+    static cq::intrusive_ptr<test_intrusive_object> make_random_unknown(cq::compressor<uint256>* compressor) {
+        uint256 hash;
+        cq::randomize(hash.begin(), 32);
+        return cq::make_intrusive<test_intrusive_object>(compressor, hash);
+    }
+};
+
+// optionally refers to another object, through its compressor
+struct test_compressing_object : public test_object {
+    using test_object::test_object;
+    uint8_t m_refers{0};
+    uint256 m_ref;
+    void serialize(cq::serializer* stream) const override {
+        test_object::serialize(stream);
+        cq::serialize(*stream, m_refers);
+        if (m_refers) m_compressor->compress(stream, m_ref);
+    }
+    void deserialize(cq::serializer* stream) override {
+        test_object::deserialize(stream);
+        cq::deserialize(*stream, m_refers);
+        if (m_refers) m_compressor->decompress(stream, m_ref);
+    }
+};
+
 class test_registry_delegate : public cq::registry_delegate {
 public:
     virtual void registry_closing_cluster(cq::id cluster) override {}
@@ -50,17 +81,36 @@ static const uint8_t cmd_mass = 0x03;   // mass <objects>
 static const uint8_t cmd_mass_compressed = 0x04; // mass_compressed <objects>
 static const uint8_t cmd_nop = 0x05;    // nop
 
-class test_chronology : public cq::chronology<uint256, test_object> {
+template<typename F, typename T = test_object>
+class test_chronology_t : public cq::chronology<uint256, T, F> {
 public:
-    using cq::chronology<uint256, test_object>::chronology;
+    using cq::chronology<uint256, T, F>::chronology;
+    using cq::chronology<uint256, T, F>::m_file;
+    using cq::chronology<uint256, T, F>::pop_event;
+    using cq::chronology<uint256, T, F>::pop_object;
+    using cq::chronology<uint256, T, F>::pop_reference;
+    using cq::chronology<uint256, T, F>::pop_reference_hashes;
+    using cq::chronology<uint256, T, F>::decompress;
+    using cq::chronology<uint256, T, F>::replaying_index_only;
+    using cq::chronology<uint256, T, F>::skip_object;
+    using cq::chronology<uint256, T, F>::skip_references;
+    using cq::chronology<uint256, T, F>::skip_compressed_references;
     bool registry_iterate(cq::file* file) override {
-        m_file = file;
+        m_file = static_cast<F*>(file);
         uint8_t cmd;
         bool known;
         uint256 hash;
         std::set<uint256> hash_set;
         std::vector<uint256> hash_vec;
         if (!pop_event(cmd, known)) return false;
+        if (replaying_index_only()) {
+            switch (cmd) {
+            case cmd_reg: skip_object(); return true;
+            case cmd_mass: skip_references(); return true;
+            case cmd_mass_compressed: skip_compressed_references(); return true;
+            default: break;
+            }
+        }
         switch (cmd) {
         case cmd_reg:
             pop_object();
@@ -83,15 +133,17 @@ public:
     }
 };
 
-inline std::shared_ptr<cq::db<uint256>> open_db(const std::string& dbpath = "/tmp/cq-db-tests", bool reset = false) {
+typedef test_chronology_t<cq::file> test_chronology;
+
+inline std::shared_ptr<cq::db<uint256>> open_db(const std::string& dbpath = "/tmp/cq-db-tests", bool reset = false, uint8_t backend = cq::stdio_backend) {
     if (reset) cq::rmdir_r(dbpath);
-    auto rv = std::make_shared<cq::db<uint256>>(dbpath, "cluster", 1008);
+    auto rv = std::make_shared<cq::db<uint256>>(dbpath, "cluster", 1008, false, backend);
     rv->load();
     return rv;
 }
 
-inline std::shared_ptr<cq::db<uint256>> new_db(const std::string& dbpath = "/tmp/cq-db-tests") {
-    return open_db(dbpath, true);
+inline std::shared_ptr<cq::db<uint256>> new_db(const std::string& dbpath = "/tmp/cq-db-tests", uint8_t backend = cq::stdio_backend) {
+    return open_db(dbpath, true, backend);
 }
 
 inline size_t db_file_count(const std::string& dbpath = "/tmp/cq-db-tests") {
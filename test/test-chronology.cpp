@@ -248,6 +248,34 @@ TEST_CASE("chronology", "[chronology]") {
         }
     }
 
+    SECTION("partially written event") {
+        long pos;
+        {
+            auto chron = new_chronology();
+            chron->begin_segment(1);
+            pos = chron->m_file->tell();
+            chron->push_event(1557974775, cmd_nop);
+            // a header byte announcing a time varint which never arrives
+            uint8_t header_byte = cmd_nop | cq::time_rel_bits(3);
+            *chron->m_file << header_byte;
+        }
+        {
+            auto chron = open_chronology();
+            chron->m_file->seek(pos, SEEK_SET);
+            chron->m_current_time = 0;
+            uint8_t cmd;
+            bool known;
+            REQUIRE(chron->pop_event(cmd, known));
+            REQUIRE(cmd_nop == cmd);
+            auto pos2 = chron->m_file->tell();
+            REQUIRE(!chron->peek_time(ptime));
+            REQUIRE(!chron->pop_event(cmd, known));
+            // position and time are left as they were
+            REQUIRE(pos2 == chron->m_file->tell());
+            REQUIRE(chron->m_current_time == 1557974775);
+        }
+    }
+
     SECTION("pushing two no-subject events") {
         long pos;
         {
@@ -1262,4 +1290,737 @@ TEST_CASE("chronology", "[chronology]") {
         chron->registry_closing_cluster(1);
         REQUIRE(chron->m_dictionary.count(ob->m_sid) == 0);
     }
+
+    SECTION("single event with 70000 subjects (push hash set)") {
+        std::set<uint256> hashes, known_hashes;
+        long pos;
+        {
+            auto chron = new_chronology();
+            chron->begin_segment(1);
+            for (int i = 0; i < 70000; ++i) {
+                auto ob = test_object::make_random_unknown(chron.get());
+                hashes.insert(ob->m_hash);
+                if (i % 7 == 0) {
+                    chron->push_event(1557974775, cmd_reg, ob, false);
+                    known_hashes.insert(ob->m_hash);
+                }
+            }
+            pos = chron->m_file->tell();
+            chron->push_event(1557974776, cmd_mass, hashes);
+        }
+        {
+            auto chron = open_chronology();
+            chron->m_file->seek(pos, SEEK_SET);
+            uint8_t cmd;
+            bool known;
+            REQUIRE(chron->pop_event(cmd, known));
+            REQUIRE(cmd == cmd_mass);
+            std::set<cq::id> known_ids;
+            std::set<uint256> unknown;
+            chron->pop_references(known_ids, unknown);
+            REQUIRE(known_ids.size() == known_hashes.size());
+            REQUIRE(unknown.size() == hashes.size() - known_hashes.size());
+            for (cq::id sid : known_ids) REQUIRE(known_hashes.count(chron->m_dictionary.at(sid)->m_hash) == 1);
+            for (const auto& h : unknown) REQUIRE(known_hashes.count(h) == 0);
+            // and again, into a vector
+            chron->m_file->seek(pos, SEEK_SET);
+            REQUIRE(chron->pop_event(cmd, known));
+            std::vector<uint256> mixed;
+            chron->pop_reference_hashes(mixed);
+            REQUIRE(mixed.size() == hashes.size());
+            REQUIRE(std::set<uint256>(mixed.begin(), mixed.end()) == hashes);
+            REQUIRE(std::set<uint256>(mixed.begin(), mixed.begin() + known_hashes.size()) == known_hashes);
+        }
+    }
+
+    SECTION("arena allocated objects") {
+        std::set<uint256> hashes;
+        {
+            auto chron = new_chronology();
+            chron->begin_segment(1);
+            for (int i = 0; i < 1000; ++i) {
+                auto ob = test_object::make_random_unknown(chron.get());
+                hashes.insert(ob->m_hash);
+                chron->push_event(1557974775 + i, cmd_reg, ob, false);
+            }
+        }
+        std::shared_ptr<test_object> kept;
+        {
+            test_chronology chron("/tmp/cq-db-tests", "cluster", 1008);
+            chron.enable_arena(4096);
+            chron.load();
+            REQUIRE(chron.m_dictionary.size() == 1000);
+            REQUIRE(chron.m_arena->chunk_count() > 1);
+            for (const auto& kv : chron.m_dictionary) REQUIRE(hashes.count(kv.second->m_hash) == 1);
+            kept = chron.m_dictionary.begin()->second;
+            chron.registry_closing_cluster(1);
+            REQUIRE(chron.m_dictionary.size() == 0);
+            REQUIRE(chron.m_arena->chunk_count() == 1);
+            REQUIRE(hashes.count(kept->m_hash) == 1);
+        }
+        REQUIRE(hashes.count(kept->m_hash) == 1);
+        REQUIRE(kept->m_sid == cq::unknownid);
+    }
+
+    SECTION("index-only replay") {
+        const std::string dbpath = "/tmp/cq-db-tests";
+        std::vector<uint256> hashes;
+        long pos;
+        {
+            auto chron = new_chronology();
+            chron->begin_segment(1);
+            for (int i = 0; i < 100; ++i) {
+                auto ob = test_object::make_random_unknown(chron.get());
+                hashes.push_back(ob->m_hash);
+                chron->push_event(1557974775 + i, cmd_reg, ob, false);
+            }
+            auto unknown = test_object::make_random_unknown(chron.get());
+            chron->push_event(1557974900, cmd_mass, std::set<uint256>{hashes[0], hashes[50], unknown->m_hash});
+            chron->push_event(1557974901, cmd_mass_compressed);
+            chron->compress(chron->m_file, std::vector<uint256>{hashes[99], unknown->m_hash});
+            pos = chron->m_file->tell();
+        }
+        std::map<uint256, cq::id> expected;
+        {
+            // a regular replay, for reference
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.load();
+            REQUIRE(chron.m_dictionary.size() == 100);
+            for (const auto& kv : chron.m_references) expected[kv.first] = kv.second;
+        }
+        REQUIRE(expected.size() == 100);
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_index_only_replay();
+            chron.load();
+            REQUIRE(chron.m_file->tell() == pos);
+            REQUIRE(chron.m_current_time == 1557974901);
+            REQUIRE(chron.m_dictionary.size() == 0);
+            REQUIRE(chron.m_references.size() == 100);
+            for (const auto& kv : chron.m_references) REQUIRE(expected.at(kv.first) == kv.second);
+            REQUIRE(chron.tretch(hashes[10]) == nullptr);
+            // appending after an index-only replay still refers to the known objects
+            auto ob = std::make_shared<test_object>(&chron, hashes[10]);
+            chron.push_event(1557974902, cmd_add, ob);
+            REQUIRE(ob->m_sid == expected.at(hashes[10]));
+        }
+        {
+            auto chron = open_chronology();
+            chron->m_file->seek(pos, SEEK_SET);
+            chron->m_current_time = 1557974901;
+            uint8_t cmd;
+            bool known;
+            REQUIRE(chron->pop_event(cmd, known));
+            REQUIRE(cmd_add == cmd);
+            REQUIRE(known);
+            REQUIRE(chron->pop_reference() == expected.at(hashes[10]));
+        }
+    }
+
+    SECTION("index-only replay of objects compressing references") {
+        typedef test_chronology_t<cq::file, test_compressing_object> compressing_chronology;
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        uint256 a_hash, b_hash;
+        cq::id a_sid, b_sid;
+        {
+            compressing_chronology chron(dbpath, "cluster", 1008);
+            chron.load();
+            chron.begin_segment(1);
+            auto a = std::make_shared<test_compressing_object>(&chron);
+            auto b = std::make_shared<test_compressing_object>(&chron);
+            cq::randomize(a->m_hash.begin(), 32);
+            cq::randomize(b->m_hash.begin(), 32);
+            b->m_refers = 1;
+            b->m_ref = a->m_hash;   // known, and compressed to a delta
+            chron.push_event(1557974775, cmd_reg, a, false);
+            chron.push_event(1557974776, cmd_reg, b, false);
+            a_hash = a->m_hash;
+            b_hash = b->m_hash;
+            a_sid = a->m_sid;
+            b_sid = b->m_sid;
+        }
+        {
+            // skipping b reads past its reference to a without resolving it
+            compressing_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_index_only_replay();
+            chron.load();
+            REQUIRE(chron.m_dictionary.size() == 0);
+            REQUIRE(chron.m_references.size() == 2);
+            REQUIRE(chron.m_references.at(a_hash) == a_sid);
+            REQUIRE(chron.m_references.at(b_hash) == b_sid);
+            auto b = std::make_shared<test_compressing_object>(&chron, b_hash);
+            chron.push_event(1557974777, cmd_add, b);
+            REQUIRE(b->m_sid == b_sid);
+        }
+        // reading it still resolves it
+        compressing_chronology chron(dbpath, "cluster", 1008, true);
+        chron.goto_segment(1);
+        uint8_t cmd;
+        bool known;
+        REQUIRE(chron.pop_event(cmd, known));
+        chron.pop_object();
+        REQUIRE(chron.pop_event(cmd, known));
+        auto b = std::static_pointer_cast<test_compressing_object>(chron.pop_object());
+        REQUIRE(b->m_sid == b_sid);
+        REQUIRE(b->m_ref == a_hash);
+    }
+
+    SECTION("sidecar index") {
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        std::vector<uint256> hashes;
+        long end;
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_sidecar_index();
+            chron.load();
+            chron.begin_segment(1);
+            for (int i = 0; i < 100; ++i) {
+                auto ob = test_object::make_random_unknown(&chron);
+                hashes.push_back(ob->m_hash);
+                chron.push_event(1557974775 + i, cmd_reg, ob, false);
+            }
+            chron.push_event(1557974900, cmd_mass, std::set<uint256>{hashes[0], hashes[50]});
+            end = chron.m_file->tell();
+        }
+        REQUIRE(cq::file::accessible(dbpath + "/cluster00000.idx"));
+        std::map<uint256, cq::id> expected;
+        {
+            // a regular replay, for reference
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.load();
+            REQUIRE(chron.m_dictionary.size() == 100);
+            for (const auto& kv : chron.m_references) expected[kv.first] = kv.second;
+        }
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_sidecar_index();
+            chron.load();
+            // loaded from the sidecar, not replayed
+            REQUIRE(chron.m_dictionary.size() == 0);
+            REQUIRE(chron.m_references.size() == 100);
+            for (const auto& kv : chron.m_references) REQUIRE(expected.at(kv.first) == kv.second);
+            REQUIRE(chron.m_current_time == 1557974900);
+            REQUIRE(chron.m_file->tell() == end);
+            auto ob = std::make_shared<test_object>(&chron, hashes[20]);
+            chron.push_event(1557974901, cmd_add, ob);
+            REQUIRE(ob->m_sid == expected.at(hashes[20]));
+            end = chron.m_file->tell();
+        }
+        {
+            // appended to without updating the sidecar; it is stale, and the cluster is replayed
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.load();
+            chron.push_event(1557974902, cmd_nop);
+        }
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_sidecar_index();
+            chron.load();
+            REQUIRE(chron.m_dictionary.size() == 100);
+            REQUIRE(chron.m_references.size() == 100);
+            REQUIRE(chron.m_current_time == 1557974902);
+            REQUIRE(chron.m_file->tell() > end);
+            // flushing through the db writes the sidecar, but only if the cluster has grown
+            cq::db<uint256>& db = chron;
+            const std::string sidecar = dbpath + "/cluster00000.idx";
+            REQUIRE(cq::rmfile(sidecar));
+            db.flush();
+            REQUIRE(cq::file::accessible(sidecar));
+            REQUIRE(cq::rmfile(sidecar));
+            db.flush();
+            REQUIRE(!cq::file::accessible(sidecar));
+            chron.push_event(1557974903, cmd_nop);
+            db.flush();
+            REQUIRE(cq::file::accessible(sidecar));
+        }
+    }
+
+    SECTION("cross-cluster references") {
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        uint256 a_hash, b_hash, c_hash;
+        long xref_size, hashref_size;
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_carry_over(10);
+            chron.load();
+            chron.begin_segment(1);
+            auto a = test_object::make_random_unknown(&chron);
+            auto b = test_object::make_random_unknown(&chron);
+            auto c = test_object::make_random_unknown(&chron);
+            a_hash = a->m_hash;
+            b_hash = b->m_hash;
+            c_hash = c->m_hash;
+            chron.push_event(1557974775, cmd_reg, a, false);
+            chron.push_event(1557974776, cmd_reg, b, false);
+            chron.begin_segment(1008);
+            REQUIRE(chron.get_cluster() == 1);
+            REQUIRE(chron.m_references.size() == 0);
+            long pos = chron.m_file->tell();
+            chron.push_event(1557974777, cmd_add, a);
+            xref_size = chron.m_file->tell() - pos;
+            // a is now known in cluster 1
+            REQUIRE(chron.m_references.count(a_hash) == 1);
+            REQUIRE(a->m_sid > pos);
+            chron.push_event(1557974778, cmd_add, a);
+            chron.push_event(1557974779, cmd_add, b);
+            pos = chron.m_file->tell();
+            chron.push_event(1557974780, cmd_add, c);
+            hashref_size = chron.m_file->tell() - pos;
+        }
+        REQUIRE(xref_size < hashref_size);
+        for (int carry = 0; carry < 2; ++carry) {
+            // with carry-over, read from the start, otherwise start in cluster 1 and fetch a and b from cluster 0
+            test_chronology chron(dbpath, "cluster", 1008, true);
+            if (carry) chron.enable_carry_over(10);
+            chron.goto_segment(carry ? 1 : 1008);
+            uint8_t cmd;
+            bool known;
+            test_chronology::ptr a;
+            if (carry) {
+                REQUIRE(chron.pop_event(cmd, known));
+                REQUIRE(cmd_reg == cmd);
+                a = chron.pop_object();
+                REQUIRE(chron.pop_event(cmd, known));
+                REQUIRE(cmd_reg == cmd);
+                chron.pop_object();
+            }
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(chron.get_cluster() == 1);
+            REQUIRE(cmd_add == cmd);
+            REQUIRE(known);
+            cq::id sid = chron.pop_reference();
+            REQUIRE(chron.m_dictionary.at(sid)->m_hash == a_hash);
+            if (carry) REQUIRE(chron.m_dictionary.at(sid) == a);
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(known);
+            REQUIRE(chron.pop_reference() == sid);
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(known);
+            REQUIRE(chron.m_dictionary.at(chron.pop_reference())->m_hash == b_hash);
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(!known);
+            uint256 hash;
+            REQUIRE(chron.pop_reference(hash) == c_hash);
+            REQUIRE(!chron.pop_event(cmd, known));
+        }
+    }
+
+    SECTION("carry-over capacity") {
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        test_chronology chron(dbpath, "cluster", 1008);
+        chron.enable_carry_over(50);
+        chron.load();
+        std::vector<test_chronology::ptr> obs;
+        for (int cluster = 0; cluster < 3; ++cluster) {
+            chron.begin_segment(1 + 1008 * cluster);
+            for (int i = 0; i < 40; ++i) {
+                obs.push_back(test_object::make_random_unknown(&chron));
+                chron.push_event(1557974775 + i, cmd_reg, obs.back(), false);
+            }
+        }
+        chron.begin_segment(1 + 1008 * 3);
+        // the 50 most recently seen objects are carried over
+        REQUIRE(chron.m_carried.size() == 50);
+        REQUIRE(chron.m_carried_hashes.size() == 50);
+        for (size_t i = 0; i < obs.size(); ++i) {
+            REQUIRE(chron.m_carried_hashes.count(obs[i]->m_hash) == (i >= obs.size() - 50));
+        }
+    }
+
+    SECTION("objects compressing references are not carried over") {
+        typedef test_chronology_t<cq::file, test_compressing_object> compressing_chronology;
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        uint256 a_hash, c_hash;
+        {
+            compressing_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_carry_over(10);
+            chron.load();
+            chron.begin_segment(1);
+            auto a = std::make_shared<test_compressing_object>(&chron);
+            auto c = std::make_shared<test_compressing_object>(&chron);
+            cq::randomize(a->m_hash.begin(), 32);
+            cq::randomize(c->m_hash.begin(), 32);
+            c->m_refers = 1;
+            c->m_ref = a->m_hash;   // known, and compressed to a delta within cluster 0
+            a_hash = a->m_hash;
+            c_hash = c->m_hash;
+            chron.push_event(1557974775, cmd_reg, a, false);
+            chron.push_event(1557974776, cmd_reg, c, false);
+            chron.begin_segment(1008);
+            REQUIRE(chron.m_carried_hashes.count(a_hash) == 1);
+            REQUIRE(chron.m_carried_hashes.count(c_hash) == 0);
+            chron.push_event(1557974777, cmd_add, a);
+            chron.push_event(1557974778, cmd_add, c);
+        }
+        for (int carry = 0; carry < 2; ++carry) {
+            // with carry-over, read from the start, otherwise start in cluster 1
+            compressing_chronology chron(dbpath, "cluster", 1008, true);
+            if (carry) chron.enable_carry_over(10);
+            chron.goto_segment(carry ? 1 : 1008);
+            uint8_t cmd;
+            bool known;
+            if (carry) {
+                REQUIRE(chron.pop_event(cmd, known));
+                chron.pop_object();
+                REQUIRE(chron.pop_event(cmd, known));
+                auto c = chron.pop_object();
+                REQUIRE(std::static_pointer_cast<test_compressing_object>(c)->m_ref == a_hash);
+            }
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(chron.get_cluster() == 1);
+            REQUIRE(known);
+            REQUIRE(chron.m_dictionary.at(chron.pop_reference())->m_hash == a_hash);
+            // c is referred to by hash
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(!known);
+            uint256 hash;
+            REQUIRE(chron.pop_reference(hash) == c_hash);
+        }
+    }
+
+    SECTION("interned unknown references") {
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        auto unknown = test_object::make_random_unknown(nullptr);
+        auto unknown2 = test_object::make_random_unknown(nullptr);
+        std::vector<uint256> compressed{unknown->m_hash, unknown2->m_hash};
+        long pos;
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_interning();
+            chron.load();
+            chron.begin_segment(1);
+            chron.push_event(1557974775, cmd_add, unknown);
+            chron.push_event(1557974776, cmd_mass_compressed);
+            chron.compress(chron.m_file, compressed);
+        }
+        {
+            // resuming replays the cluster, and picks up the hashes in it
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.load();
+            pos = chron.m_file->tell();
+            chron.push_event(1557974777, cmd_add, unknown2);
+            REQUIRE(chron.m_file->tell() - pos < 4);
+        }
+        {
+            auto chron = open_chronology();
+            chron->m_file->seek(pos, SEEK_SET);
+            chron->m_current_time = 1557974776;
+            uint8_t cmd;
+            bool known;
+            uint256 hash;
+            REQUIRE(chron->pop_event(cmd, known));
+            REQUIRE(!known);
+            REQUIRE(chron->pop_reference(hash) == unknown2->m_hash);
+        }
+    }
+
+    SECTION("jumping to a segment in the middle of a cluster") {
+        {
+            auto chron = new_chronology();
+            for (int segment = 1; segment < 5; ++segment) {
+                chron->begin_segment(segment);
+                chron->push_event(1557974775 + segment * 100, cmd_nop);
+                chron->push_event(1557974775 + segment * 100 + 1, cmd_nop);
+            }
+        }
+        for (int segment = 4; segment > 0; --segment) {
+            test_chronology chron("/tmp/cq-db-tests", "cluster", 1008, true);
+            chron.goto_segment(segment);
+            REQUIRE(chron.get_cluster() == 0);
+            uint8_t cmd;
+            bool known;
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(cmd_nop == cmd);
+            REQUIRE(chron.m_current_time == 1557974775 + segment * 100);
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(chron.m_current_time == 1557974775 + segment * 100 + 1);
+        }
+    }
+
+    SECTION("checkpoints") {
+        // each segment stores two objects, and refers to an object from the segment before it
+        std::vector<uint256> hashes;
+        {
+            auto chron = new_chronology();
+            chron->enable_checkpoints(2);
+            std::vector<std::shared_ptr<test_object>> obs;
+            for (int segment = 1; segment < 8; ++segment) {
+                chron->begin_segment(segment);
+                long t = 1557974775 + segment * 100;
+                if (obs.size()) chron->push_event(t, cmd_del, obs[obs.size() - 2]);
+                for (int i = 0; i < 2; ++i) {
+                    obs.push_back(test_object::make_random_unknown(chron.get()));
+                    hashes.push_back(obs.back()->m_hash);
+                    chron->push_event(t + 1 + i, cmd_reg, obs.back(), false);
+                }
+            }
+        }
+        REQUIRE(cq::file::accessible("/tmp/cq-db-tests/cluster00000.chk"));
+        for (int segment = 2; segment < 8; ++segment) {
+            test_chronology chron("/tmp/cq-db-tests", "cluster", 1008, true);
+            chron.enable_checkpoints(2);
+            chron.goto_segment(segment);
+            // everything stored before the segment is known, whether from a checkpoint or replayed
+            REQUIRE(chron.m_dictionary.size() == (segment - 1) * 2);
+            REQUIRE(chron.m_current_time == 1557974775 + (segment - 1) * 100 + 2);
+            uint8_t cmd;
+            bool known;
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(cmd_del == cmd);
+            REQUIRE(known);
+            REQUIRE(chron.m_dictionary.at(chron.pop_reference())->m_hash == hashes[(segment - 2) * 2]);
+            REQUIRE(chron.pop_event(cmd, known));
+            REQUIRE(cmd_reg == cmd);
+            REQUIRE(chron.pop_object()->m_hash == hashes[(segment - 1) * 2]);
+        }
+        {
+            // without checkpoints, the dictionary is empty
+            test_chronology chron("/tmp/cq-db-tests", "cluster", 1008, true);
+            chron.goto_segment(5);
+            REQUIRE(chron.m_dictionary.size() == 0);
+        }
+    }
+
+    SECTION("checkpoints after resuming from a sidecar index") {
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        uint256 a_hash, b_hash;
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_carry_over(10);
+            chron.enable_sidecar_index();
+            chron.enable_checkpoints(2);
+            chron.load();
+            chron.begin_segment(1);
+            auto a = test_object::make_random_unknown(&chron);
+            a_hash = a->m_hash;
+            chron.push_event(1557974775, cmd_reg, a, false);
+            chron.begin_segment(1009);
+            // a is imported into cluster 1, and b stored in it
+            chron.push_event(1557974776, cmd_add, a);
+            auto b = test_object::make_random_unknown(&chron);
+            b_hash = b->m_hash;
+            chron.push_event(1557974777, cmd_reg, b, false);
+        }
+        {
+            test_chronology chron(dbpath, "cluster", 1008);
+            chron.enable_carry_over(10);
+            chron.enable_sidecar_index();
+            chron.enable_checkpoints(2);
+            chron.load();
+            // loaded from the sidecar, which knows where a came from
+            REQUIRE(chron.m_dictionary.size() == 0);
+            REQUIRE(chron.m_references.size() == 2);
+            REQUIRE(chron.m_imported.size() == 1);
+            chron.begin_segment(1010);
+            chron.push_event(1557974778, cmd_del, std::make_shared<test_object>(&chron, a_hash));
+            chron.push_event(1557974779, cmd_del, std::make_shared<test_object>(&chron, b_hash));
+        }
+        REQUIRE(cq::file::accessible(dbpath + "/cluster00001.chk"));
+        test_chronology chron(dbpath, "cluster", 1008, true);
+        chron.enable_checkpoints(2);
+        chron.goto_segment(1010);
+        REQUIRE(chron.m_dictionary.size() == 2);
+        REQUIRE(chron.m_imported.size() == 1);
+        REQUIRE(chron.m_current_time == 1557974777);
+        uint8_t cmd;
+        bool known;
+        REQUIRE(chron.pop_event(cmd, known));
+        REQUIRE(cmd_del == cmd);
+        REQUIRE(known);
+        REQUIRE(chron.m_dictionary.at(chron.pop_reference())->m_hash == a_hash);
+        REQUIRE(chron.pop_event(cmd, known));
+        REQUIRE(known);
+        REQUIRE(chron.m_dictionary.at(chron.pop_reference())->m_hash == b_hash);
+    }
+
+    SECTION("goto_time") {
+        // three clusters with two segments each, and an event every 10 seconds
+        const long t0 = 1557974775;
+        long t = t0;
+        {
+            auto chron = new_chronology();
+            chron->set_time_index_interval(64);
+            for (int cluster = 0; cluster < 3; ++cluster) {
+                for (int segment = 0; segment < 2; ++segment) {
+                    chron->begin_segment(1 + cluster * 1008 + segment * 500);
+                    for (int i = 0; i < 100; ++i) {
+                        chron->push_event(t, cmd_nop);
+                        t += 10;
+                    }
+                }
+            }
+            REQUIRE(chron->get_forward_index().get_time_index().marks.size() > 2);
+        }
+        test_chronology chron("/tmp/cq-db-tests", "cluster", 1008, true);
+        for (long target : {t0 - 100, t0, t0 + 5, t0 + 1230, t0 + 2000, t0 + 2005, t0 + 3995, t0 + 5990, t - 10, t0 + 10}) {
+            REQUIRE(chron.goto_time(target));
+            long next;
+            REQUIRE(chron.peek_time(next));
+            long expected = target <= t0 ? t0 : t0 + ((target - t0 + 9) / 10) * 10;
+            REQUIRE(next == expected);
+            REQUIRE(chron.get_cluster() == (expected - t0) / 2000);
+        }
+        REQUIRE(!chron.goto_time(t));
+        // the forward indices of sealed clusters are looked up through the header cache
+        const cq::header* fi = chron.m_reg.peek_forward_index(0);
+        REQUIRE(fi);
+        REQUIRE(fi->get_time_index().marks[0].time == t0);
+        REQUIRE(chron.m_reg.peek_forward_index(0) == fi);
+    }
+
+    SECTION("intrusively refcounted objects") {
+        typedef test_chronology_t<cq::file, test_intrusive_object> intrusive_chronology;
+        static_assert(std::is_same<intrusive_chronology::ptr, cq::intrusive_ptr<test_intrusive_object>>::value, "refcounted objects are handled through intrusive_ptr");
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        std::set<uint256> hashes;
+        uint256 known_hash, unknown_hash;
+        cq::id known_sid;
+        {
+            intrusive_chronology chron(dbpath, "cluster", 1008);
+            chron.load();
+            chron.begin_segment(1);
+            std::set<intrusive_chronology::ptr> subjects;
+            for (int i = 0; i < 100; ++i) {
+                auto ob = test_intrusive_object::make_random_unknown(&chron);
+                hashes.insert(ob->m_hash);
+                chron.push_event(1557974775 + i, cmd_reg, ob, false);
+                REQUIRE(ob.use_count() == 2); // ob + m_dictionary
+                if (i < 10) subjects.insert(ob);
+            }
+            auto known = *subjects.begin();
+            auto unknown = test_intrusive_object::make_random_unknown(&chron);
+            known_hash = known->m_hash;
+            known_sid = known->m_sid;
+            unknown_hash = unknown->m_hash;
+            REQUIRE(chron.tretch(known_hash) == known);
+            REQUIRE(chron.tretch(unknown_hash) == nullptr);
+            subjects.insert(unknown);
+            chron.push_event(1557974900, cmd_add, known);
+            chron.push_event(1557974901, cmd_mass, subjects);
+        }
+        for (int arena = 0; arena < 2; ++arena) {
+            intrusive_chronology::ptr kept;
+            {
+                intrusive_chronology chron(dbpath, "cluster", 1008);
+                if (arena) chron.enable_arena(4096);
+                chron.load();
+                REQUIRE(chron.m_dictionary.size() == 100);
+                for (const auto& kv : chron.m_dictionary) REQUIRE(hashes.count(kv.second->m_hash) == 1);
+                kept = chron.tretch(known_hash);
+                REQUIRE(kept);
+                REQUIRE(kept->m_sid == known_sid);
+                REQUIRE(kept.use_count() == 2);
+            }
+            // the chronology is gone, but the object remains
+            REQUIRE(kept.use_count() == 1);
+            REQUIRE(kept->m_hash == known_hash);
+        }
+    }
+
+    SECTION("write-behind chronology") {
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        std::vector<cq::id> sids;
+        std::vector<uint256> hashes;
+        {
+            test_chronology chron(dbpath, "cluster", 1008, false, cq::ring_backend);
+            chron.load();
+            for (cq::id segment : {1, 1008}) {
+                chron.begin_segment(segment);
+                REQUIRE(dynamic_cast<cq::ring_file*>(chron.m_file));
+                for (int i = 0; i < 500; ++i) {
+                    auto ob = test_object::make_random_unknown(&chron);
+                    chron.push_event(1557974775 + i, cmd_reg, ob, false);
+                    chron.push_event(1557974775 + i, cmd_add, ob);
+                    sids.push_back(ob->m_sid);
+                    hashes.push_back(ob->m_hash);
+                }
+                chron.flush();
+                REQUIRE(0 == static_cast<cq::ring_file*>(chron.m_file)->pending());
+            }
+        }
+        // read back with the generic (stdio) chronology
+        test_chronology chron(dbpath, "cluster", 1008, true);
+        size_t i = 0;
+        for (cq::id segment : {1, 1008}) {
+            chron.goto_segment(segment);
+            chron.m_current_time = 0;
+            for (int j = 0; j < 500; ++j, ++i) {
+                uint8_t cmd;
+                bool known;
+                REQUIRE(chron.pop_event(cmd, known));
+                REQUIRE(cmd_reg == cmd);
+                auto ob = chron.pop_object();
+                REQUIRE(ob->m_sid == sids[i]);
+                REQUIRE(ob->m_hash == hashes[i]);
+                REQUIRE(chron.pop_event(cmd, known));
+                REQUIRE(cmd_add == cmd);
+                REQUIRE(known);
+                REQUIRE(chron.pop_reference() == sids[i]);
+            }
+        }
+        REQUIRE(cq::rmdir_r(dbpath));
+    }
+
+    SECTION("posix_file instantiated chronology") {
+        // a chronology templated on a concrete file type writes the same format as the generic one
+        const std::string dbpath = "/tmp/cq-db-tests";
+        cq::rmdir_r(dbpath);
+        long pos;
+        uint256 obhash, unknown_hash;
+        cq::id obid;
+        {
+            test_chronology_t<cq::posix_file> chron(dbpath, "cluster", 1008);
+            chron.load();
+            chron.begin_segment(1);
+            pos = chron.m_file->tell();
+            auto ob = test_object::make_random_unknown(&chron);
+            auto unknown = test_object::make_random_unknown(&chron);
+            obhash = ob->m_hash;
+            unknown_hash = unknown->m_hash;
+            chron.push_event(1557974775, cmd_reg, ob, false);
+            chron.push_event(1557974776, cmd_add, ob);
+            chron.push_event(1557974999, cmd_mass, std::set<uint256>{obhash, unknown_hash});
+            obid = ob->m_sid;
+        }
+        {
+            // read back with the generic (stdio) chronology
+            auto chron = open_chronology();
+            chron->m_file->seek(pos, SEEK_SET);
+            chron->m_current_time = 0;
+            uint8_t cmd;
+            bool known;
+            REQUIRE(chron->pop_event(cmd, known));
+            REQUIRE(cmd_reg == cmd);
+            REQUIRE(chron->pop_object()->m_sid == obid);
+            REQUIRE(chron->pop_event(cmd, known));
+            REQUIRE(cmd_add == cmd);
+            REQUIRE(known);
+            REQUIRE(chron->pop_reference() == obid);
+            REQUIRE(chron->pop_event(cmd, known));
+            REQUIRE(cmd_mass == cmd);
+            REQUIRE(chron->m_current_time == 1557974999);
+            std::set<uint256> hashes;
+            chron->pop_reference_hashes(hashes);
+            REQUIRE(hashes == std::set<uint256>({obhash, unknown_hash}));
+            REQUIRE(!chron->pop_event(cmd, known));
+        }
+        {
+            // and with the posix_file one, which replays the cluster on load
+            test_chronology_t<cq::posix_file> chron(dbpath, "cluster", 1008);
+            chron.load();
+            REQUIRE(chron.m_references.count(obhash) == 1);
+            REQUIRE(chron.m_references.at(obhash) == obid);
+            REQUIRE(chron.m_current_time == 1557974999);
+        }
+        REQUIRE(cq::rmdir_r(dbpath));
+    }
 }
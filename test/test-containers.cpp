@@ -0,0 +1,234 @@
+#include "catch.hpp"
+
+#include "helpers.h"
+
+#include <map>
+#include <cqdb/containers.h>
+
+// a terrible hasher, to get long probe runs
+struct colliding_hasher {
+    uint64_t operator()(const uint64_t& key) const { return key & 3; }
+};
+
+template<typename I> static void check_against(I& index, const std::map<uint64_t, uint64_t>& expected) {
+    REQUIRE(index.size() == expected.size());
+    for (const auto& kv : expected) {
+        REQUIRE(index.count(kv.first) == 1);
+        REQUIRE(index.at(kv.first) == kv.second);
+    }
+    size_t iterated = 0;
+    for (const auto& kv : index) {
+        REQUIRE(expected.count(kv.first) == 1);
+        REQUIRE(expected.at(kv.first) == kv.second);
+        ++iterated;
+    }
+    REQUIRE(iterated == expected.size());
+}
+
+TEST_CASE("Hash index", "[hash_index]") {
+    SECTION("empty") {
+        cq::hash_index<uint64_t, uint64_t> index;
+        REQUIRE(index.size() == 0);
+        REQUIRE(index.empty());
+        REQUIRE(index.count(0) == 0);
+        REQUIRE(index.find(0) == index.end());
+        REQUIRE(index.begin() == index.end());
+        REQUIRE_THROWS_AS(index.at(0), std::out_of_range);
+        REQUIRE(index.erase(0) == 0);
+    }
+
+    SECTION("insertion and lookup") {
+        cq::hash_index<uint64_t, uint64_t> index;
+        std::map<uint64_t, uint64_t> expected;
+        for (uint64_t i = 0; i < 10000; ++i) {
+            uint64_t k = i * 2654435761ull;
+            index[k] = i;
+            expected[k] = i;
+        }
+        check_against(index, expected);
+        // the load factor is bounded
+        REQUIRE(index.size() * 4 <= index.capacity() * 3);
+        // overwriting does not insert
+        index[0] = 123;
+        REQUIRE(index.size() == 10000);
+        REQUIRE(index.at(0) == 123);
+        auto it = index.find(2654435761ull);
+        REQUIRE(it != index.end());
+        REQUIRE(it->first == 2654435761ull);
+        REQUIRE(it->second == 1);
+        it->second = 5;
+        REQUIRE(index.at(2654435761ull) == 5);
+        REQUIRE(index.count(3) == 0);
+    }
+
+    SECTION("erase") {
+        cq::hash_index<uint64_t, uint64_t, colliding_hasher> index;
+        std::map<uint64_t, uint64_t> expected;
+        for (uint64_t i = 0; i < 200; ++i) {
+            index[i * 3] = i;
+            expected[i * 3] = i;
+        }
+        check_against(index, expected);
+        for (uint64_t i = 0; i < 200; i += 3) {
+            REQUIRE(index.erase(i * 3) == 1);
+            REQUIRE(index.erase(i * 3) == 0);
+            expected.erase(i * 3);
+            REQUIRE(index.count(i * 3) == 0);
+        }
+        check_against(index, expected);
+        // and re-insert some
+        for (uint64_t i = 0; i < 200; i += 6) {
+            index[i * 3] = i + 1;
+            expected[i * 3] = i + 1;
+        }
+        check_against(index, expected);
+    }
+
+    SECTION("clear keeps capacity") {
+        cq::hash_index<uint64_t, uint64_t> index;
+        for (uint64_t i = 0; i < 1000; ++i) index[i] = i;
+        size_t capacity = index.capacity();
+        index.clear();
+        REQUIRE(index.size() == 0);
+        REQUIRE(index.capacity() == capacity);
+        REQUIRE(index.count(5) == 0);
+        for (uint64_t i = 0; i < 1000; ++i) index[i + 1000] = i;
+        REQUIRE(index.capacity() == capacity);
+        REQUIRE(index.size() == 1000);
+        REQUIRE(index.at(1999) == 999);
+    }
+
+    SECTION("reserve") {
+        cq::hash_index<uint64_t, uint64_t> index;
+        index.reserve(1000);
+        size_t capacity = index.capacity();
+        REQUIRE(capacity >= 1334);
+        for (uint64_t i = 0; i < 1000; ++i) index[i] = i;
+        REQUIRE(index.capacity() == capacity);
+    }
+
+    SECTION("prehashed uint256 keys") {
+        cq::hash_index<uint256, cq::id> index;
+        std::map<uint256, cq::id> expected;
+        for (cq::id i = 1; i <= 5000; ++i) {
+            uint256 hash;
+            cq::randomize(hash.begin(), 32);
+            index[hash] = i;
+            expected[hash] = i;
+        }
+        REQUIRE(index.size() == expected.size());
+        for (const auto& kv : expected) REQUIRE(index.at(kv.first) == kv.second);
+        uint256 unknown;
+        cq::randomize(unknown.begin(), 32);
+        REQUIRE(index.count(unknown) == 0);
+    }
+}
+
+TEST_CASE("Flat map", "[flat_map]") {
+    SECTION("empty") {
+        cq::flat_map<uint64_t, uint64_t> m;
+        REQUIRE(m.size() == 0);
+        REQUIRE(m.empty());
+        REQUIRE(m.count(0) == 0);
+        REQUIRE(m.find(0) == m.end());
+        REQUIRE(m.begin() == m.end());
+        REQUIRE_THROWS_AS(m.at(0), std::out_of_range);
+        REQUIRE(m.erase(0) == 0);
+    }
+
+    SECTION("appending in order") {
+        cq::flat_map<uint64_t, uint64_t> m;
+        for (uint64_t i = 1; i <= 1000; ++i) m[i * 10] = i;
+        REQUIRE(m.size() == 1000);
+        for (uint64_t i = 1; i <= 1000; ++i) {
+            REQUIRE(m.count(i * 10) == 1);
+            REQUIRE(m.count(i * 10 + 1) == 0);
+            REQUIRE(m.at(i * 10) == i);
+        }
+        REQUIRE(m.count(0) == 0);
+        REQUIRE(m.count(10001) == 0);
+        uint64_t prev = 0;
+        for (const auto& kv : m) {
+            REQUIRE(kv.first > prev);
+            REQUIRE(kv.second * 10 == kv.first);
+            prev = kv.first;
+        }
+    }
+
+    SECTION("out of order insertion, overwrite and erase") {
+        cq::flat_map<uint64_t, uint64_t> m;
+        std::map<uint64_t, uint64_t> expected;
+        for (uint64_t i = 0; i < 500; ++i) {
+            uint64_t k = (i * 7919) % 1000;
+            m[k] = i;
+            expected[k] = i;
+        }
+        m[5] = 1234;
+        expected[5] = 1234;
+        for (uint64_t k = 0; k < 1000; k += 3) {
+            REQUIRE(m.erase(k) == expected.erase(k));
+        }
+        REQUIRE(m.size() == expected.size());
+        auto it = expected.begin();
+        for (const auto& kv : m) {
+            REQUIRE(kv.first == it->first);
+            REQUIRE(kv.second == it->second);
+            ++it;
+        }
+        auto f = m.find(5);
+        REQUIRE(f != m.end());
+        REQUIRE(f->second == 1234);
+    }
+
+    SECTION("clear releases values") {
+        cq::flat_map<uint64_t, std::shared_ptr<int>> m;
+        auto p = std::make_shared<int>(1);
+        for (uint64_t i = 0; i < 100; ++i) m[i] = p;
+        REQUIRE(p.use_count() == 101);
+        m.clear();
+        REQUIRE(m.size() == 0);
+        REQUIRE(p.use_count() == 1);
+        REQUIRE(m.count(5) == 0);
+    }
+}
+
+TEST_CASE("Arena", "[arena]") {
+    SECTION("allocation") {
+        cq::arena a(1024);
+        REQUIRE(a.chunk_count() == 0);
+        std::vector<uint64_t*> ps;
+        for (uint64_t i = 0; i < 100; ++i) {
+            uint64_t* p = (uint64_t*)a.allocate(sizeof(uint64_t) * 3);
+            REQUIRE(((uintptr_t)p % alignof(std::max_align_t)) == 0);
+            p[0] = p[1] = p[2] = i;
+            ps.push_back(p);
+        }
+        REQUIRE(a.chunk_count() > 1);
+        // oversized allocations get a chunk of their own
+        void* big = a.allocate(4096);
+        memset(big, 0xff, 4096);
+        for (uint64_t i = 0; i < 100; ++i) REQUIRE(ps[i][2] == i);
+        for (uint64_t* p : ps) cq::arena::deallocate(p);
+        cq::arena::deallocate(big);
+        a.reset();
+        REQUIRE(a.chunk_count() == 1);
+    }
+
+    SECTION("allocations outliving a reset and the arena") {
+        std::shared_ptr<uint64_t> survivor;
+        {
+            cq::arena a(256);
+            std::vector<std::shared_ptr<uint64_t>> obs;
+            for (uint64_t i = 0; i < 50; ++i) obs.push_back(std::allocate_shared<uint64_t>(cq::arena_allocator<uint64_t>(&a), i));
+            survivor = obs[7];
+            obs.clear();
+            a.reset();
+            REQUIRE(*survivor == 7);
+            auto other = std::allocate_shared<uint64_t>(cq::arena_allocator<uint64_t>(&a), 123);
+            REQUIRE(*survivor == 7);
+            REQUIRE(*other == 123);
+        }
+        REQUIRE(*survivor == 7);
+        survivor.reset();
+    }
+}
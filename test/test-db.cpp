@@ -72,6 +72,120 @@ TEST_CASE("Header", "[header]") {
         REQUIRE(2 == hdr2.get_segment_position(1));
         REQUIRE(3 == hdr2.get_segment_position(999999));
     }
+
+    SECTION("segment times (version 6)") {
+        for (uint8_t version = 5; version < 7; ++version) {
+            cq::header hdr(version, (cq::id)0);
+            hdr.mark_segment(1, 2);
+            hdr.mark_segment(2, 30);
+            hdr.mark_segment_time(1, 0);
+            hdr.mark_segment_time(2, 1557974775);
+            cq::chv_stream stm;
+            stm << hdr;
+            stm.seek(0, SEEK_SET);
+            cq::header hdr2(0, &stm);
+            REQUIRE(2 == hdr2.get_segment_count());
+            REQUIRE(hdr2.has_segment_time(1) == (version >= 6));
+            REQUIRE(hdr2.has_segment_time(2) == (version >= 6));
+            if (version >= 6) {
+                REQUIRE(0 == hdr2.get_segment_time(1));
+                REQUIRE(1557974775 == hdr2.get_segment_time(2));
+            }
+        }
+    }
+
+    SECTION("time index (version 7)") {
+        cq::header hdr(7, (cq::id)0);
+        for (long i = 0; i < 300; ++i) {
+            hdr.mark_time(1557974775 + i * 60, 1557974775 + i * 60 - (i % 3), 3 + i * 1000, 1 + i / 100);
+        }
+        cq::chv_stream stm;
+        stm << hdr;
+        stm.seek(0, SEEK_SET);
+        cq::header hdr2(0, &stm);
+        const auto& marks = hdr2.get_time_index().marks;
+        REQUIRE(300 == marks.size());
+        for (long i = 0; i < 300; ++i) {
+            REQUIRE(marks[i].time == 1557974775 + i * 60);
+            REQUIRE(marks[i].clock == 1557974775 + i * 60 - (i % 3));
+            REQUIRE(marks[i].position == 3 + i * 1000);
+            REQUIRE(marks[i].segment == 1 + i / 100);
+        }
+        REQUIRE(hdr2.get_time_index().find(0) == &marks[0]);
+        REQUIRE(hdr2.get_time_index().find(1557974775 + 60) == &marks[0]);
+        REQUIRE(hdr2.get_time_index().find(1557974775 + 61) == &marks[1]);
+        REQUIRE(hdr2.get_time_index().find(1557974775 + 1000000) == &marks[299]);
+    }
+
+    SECTION("log (version 8)") {
+        cq::header hdr(8, (cq::id)0);
+        hdr.set_flags(cq::HEADER_INTERNED);
+        hdr.mark_segment(1, 2);
+        hdr.mark_segment_time(1, 1557974775);
+        // the count is updated in place, which chv_streams do not do
+        cq::file stm("/tmp/cq-header-log", false, true);
+        hdr.write_log(&stm);
+        auto size = stm.tell();
+        REQUIRE(!hdr.append_log(&stm));
+        REQUIRE(stm.tell() == size);
+        hdr.mark_segment(5, 300);
+        hdr.mark_time(1557974800, 1557974775, 310, 5);
+        hdr.mark_segment(1, 3); // changes are logged, not just additions
+        REQUIRE(hdr.append_log(&stm));
+        stm.seek(0, SEEK_SET);
+        cq::header hdr2(0, &stm);
+        REQUIRE(8 == hdr2.get_version());
+        REQUIRE(cq::HEADER_INTERNED == hdr2.get_flags());
+        REQUIRE(2 == hdr2.get_segment_count());
+        REQUIRE(3 == hdr2.get_segment_position(1));
+        REQUIRE(300 == hdr2.get_segment_position(5));
+        REQUIRE(1557974775 == hdr2.get_segment_time(1));
+        REQUIRE(1 == hdr2.get_time_index().marks.size());
+        REQUIRE(1557974775 == hdr2.get_time_index().marks[0].clock);
+        REQUIRE(310 == hdr2.get_time_index().marks[0].position);
+        // records beyond the count are ignored
+        hdr.mark_segment(9, 400);
+        hdr.end_log();
+        stm.seek(0, SEEK_SET);
+        hdr.write_log(&stm);
+        stm.seek(0, SEEK_SET);
+        cq::header hdr3(0, &stm);
+        REQUIRE(3 == hdr3.get_segment_count());
+        // and the compact form is unchanged
+        cq::chv_stream stm3;
+        stm3 << hdr;
+        stm3.seek(0, SEEK_SET);
+        cq::header hdr4(0, &stm3);
+        REQUIRE(3 == hdr4.get_segment_count());
+        REQUIRE(cq::HEADER_INTERNED == hdr4.get_flags());
+    }
+
+    SECTION("many segments, version 1 and 2") {
+        cq::header hdr1(1, (cq::id)0);
+        cq::header hdr2(2, (cq::id)0);
+        cq::id pos = 3;
+        for (cq::id seg = 1000; seg < 2000; ++seg) {
+            pos += 200 + (seg * 7919) % 3000;
+            hdr1.mark_segment(seg, pos);
+            hdr2.mark_segment(seg, pos);
+        }
+        cq::chv_stream stm1, stm2;
+        stm1 << hdr1;
+        stm2 << hdr2;
+        REQUIRE(stm2.tell() < stm1.tell());
+        stm1.seek(0, SEEK_SET);
+        stm2.seek(0, SEEK_SET);
+        cq::header rhdr1(0, &stm1);
+        cq::header rhdr2(0, &stm2);
+        REQUIRE(1 == rhdr1.get_version());
+        REQUIRE(2 == rhdr2.get_version());
+        REQUIRE(1000 == rhdr1.get_segment_count());
+        REQUIRE(1000 == rhdr2.get_segment_count());
+        for (cq::id seg = 1000; seg < 2000; ++seg) {
+            REQUIRE(hdr1.get_segment_position(seg) == rhdr1.get_segment_position(seg));
+            REQUIRE(hdr1.get_segment_position(seg) == rhdr2.get_segment_position(seg));
+        }
+    }
 }
 
 TEST_CASE("Registry", "[registry]") {
@@ -81,8 +195,8 @@ TEST_CASE("Registry", "[registry]") {
         REQUIRE(empty.get_clusters().size() == 0);
         cq::chv_stream stream;
         stream << empty;
-        // should be able to serialize above registry in 6 bytes (size (1) + cluster size (4) + tip (1))
-        REQUIRE(stream.tell() == 6);
+        // should be able to serialize above registry in 11 bytes (version marker (4 + 1) + size (1) + cluster size (4) + tip (1))
+        REQUIRE(stream.tell() == 11);
         cq::registry reg2(&regdel, "/tmp/cq-reg", "reg");
         stream.seek(0, SEEK_SET);
         stream >> reg2;
@@ -95,8 +209,8 @@ TEST_CASE("Registry", "[registry]") {
         REQUIRE(one.get_clusters().size() == 1);
         cq::chv_stream stream;
         stream << one;
-        // should be able to serialize above registry in 7 bytes (size (1) + entry (1) + cluster size (4) + tip (1))
-        REQUIRE(stream.tell() == 7);
+        // should be able to serialize above registry in 12 bytes (version marker (4 + 1) + size (1) + entry (1) + cluster size (4) + tip (1))
+        REQUIRE(stream.tell() == 12);
         cq::registry reg2(&regdel, "/tmp/cq-reg", "reg");
         stream.seek(0, SEEK_SET);
         stream >> reg2;
@@ -111,9 +225,9 @@ TEST_CASE("Registry", "[registry]") {
         REQUIRE(reg.get_clusters().size() == 2);
         cq::chv_stream stream;
         stream << reg;
-        // should be able to serialize above registry in 8 bytes (size (1) + entries (1 + 1) + cluster size (4) + tip (1))
+        // should be able to serialize above registry in 13 bytes (version marker (4 + 1) + size (1) + entries (1 + 1) + cluster size (4) + tip (1))
         // note that entry 2 is 128, but relative, so 127
-        REQUIRE(stream.tell() == 8);
+        REQUIRE(stream.tell() == 13);
         cq::registry reg2(&regdel, "/tmp/cq-reg", "reg");
         stream.seek(0, SEEK_SET);
         stream >> reg2;
@@ -129,14 +243,72 @@ TEST_CASE("Registry", "[registry]") {
         REQUIRE(reg.get_clusters().size() == 2);
         cq::chv_stream stream;
         stream << reg;
-        // should be able to serialize above registry in 8 bytes (size (1) + entries (1 + 1) + cluster size (4) + tip (1))
+        // should be able to serialize above registry in 13 bytes (version marker (4 + 1) + size (1) + entries (1 + 1) + cluster size (4) + tip (1))
         // why 1 + 1 despite 2015? because we are storing the *cluster numbers* not the segment ids, i.e. 0 and 1 not 2015 and 2016
         // why 1 for tip, despite it being 2016? because tip is serialized as (tip - cluster * cluster_size) i.e. (2016 - 1 * 2016) = 0, here
-        REQUIRE(stream.tell() == 8);
+        REQUIRE(stream.tell() == 13);
+        cq::registry reg2(&regdel, "/tmp/cq-reg", "reg");
+        stream.seek(0, SEEK_SET);
+        stream >> reg2;
+        REQUIRE(reg == reg2);
+    }
+
+    SECTION("many entries") {
+        cq::registry reg(&regdel, "/tmp/cq-reg", "reg", 10);
+        for (cq::id i = 0; i < 10000; ++i) reg.prepare_cluster_for_segment(i * 10 + (i & 3) * 10);
+        REQUIRE(reg.get_clusters().size() > 5000);
+        cq::chv_stream stream;
+        stream << reg;
+        cq::registry reg2(&regdel, "/tmp/cq-reg", "reg");
+        stream.seek(0, SEEK_SET);
+        stream >> reg2;
+        REQUIRE(reg == reg2);
+        REQUIRE(stream.eof());
+        // the bitpacked cluster list is smaller than the varint one
+        cq::chv_stream legacy;
+        reg.get_clusters().serialize(&legacy, 1);
+        REQUIRE(stream.tell() < legacy.tell());
+    }
+
+    SECTION("unversioned (version 1) registry") {
+        cq::registry reg(&regdel, "/tmp/cq-reg", "reg", 2016);
+        reg.prepare_cluster_for_segment(1 * 2016);
+        reg.prepare_cluster_for_segment(128 * 2016 + 5);
+        cq::chv_stream stream;
+        stream << reg.m_cluster_size;
+        reg.get_clusters().serialize(&stream, 1);
+        stream << cq::varint(5);
         cq::registry reg2(&regdel, "/tmp/cq-reg", "reg");
         stream.seek(0, SEEK_SET);
         stream >> reg2;
         REQUIRE(reg == reg2);
+        REQUIRE(reg2.m_tip == 128 * 2016 + 5);
+    }
+
+    SECTION("registry versions") {
+        cq::registry reg(&regdel, "/tmp/cq-reg", "reg", 2016);
+        reg.prepare_cluster_for_segment(1 * 2016);
+        reg.prepare_cluster_for_segment(128 * 2016 + 5);
+        for (uint8_t version = 2; version <= cq::REGISTRY_VERSION + 1; ++version) {
+            cq::chv_stream stream;
+            stream << uint32_t(0) << version << reg.m_cluster_size;
+            reg.get_clusters().serialize(&stream, version);
+            stream << cq::varint(5);
+            cq::registry reg2(&regdel, "/tmp/cq-reg", "reg");
+            stream.seek(0, SEEK_SET);
+            if (version > cq::REGISTRY_VERSION) {
+                REQUIRE_THROWS_AS(stream >> reg2, cq::db_error);
+            } else {
+                stream >> reg2;
+                REQUIRE(reg == reg2);
+            }
+        }
+        cq::chv_stream stream;
+        stream << reg;
+        stream.seek(4, SEEK_SET);
+        uint8_t version;
+        stream >> version;
+        REQUIRE(version == cq::REGISTRY_VERSION);
     }
 }
 
@@ -264,6 +436,66 @@ TEST_CASE("Database", "[db]") {
         }
     }
 
+    SECTION("should remember file states on reopen (posix/mmap backends)") {
+        cq::id obid, obid2;
+        uint256 obhash, obhash2;
+        long pos;
+        {
+            auto db = new_db("/tmp/cq-db-tests", cq::posix_backend);
+            auto ob = test_object::make_random_unknown(nullptr);
+            auto ob2 = test_object::make_random_unknown(nullptr);
+            obhash = ob->m_hash;
+            obhash2 = ob2->m_hash;
+            db->begin_segment(1);
+            pos = db->m_file->tell();
+            obid = db->store(ob.get());
+            db->begin_segment(1008);
+            obid2 = db->store(ob2.get());
+        }
+        for (uint8_t backend : {(uint8_t)cq::posix_backend, (uint8_t)(cq::posix_backend | cq::mmap_backend)}) {
+            cq::db<uint256> db("/tmp/cq-db-tests", "cluster", 1008, true, backend);
+            db.load();
+            db.goto_segment(1);
+            REQUIRE(pos == db.m_file->tell());
+            test_object ob(nullptr);
+            db.load(&ob);
+            REQUIRE(ob.m_sid == obid);
+            REQUIRE(ob.m_hash == obhash);
+            db.goto_segment(1008);
+            db.load(&ob);
+            REQUIRE(ob.m_sid == obid2);
+            REQUIRE(ob.m_hash == obhash2);
+        }
+        {
+            auto db = open_db("/tmp/cq-db-tests", false, cq::posix_backend);
+            db->goto_segment(1);
+            REQUIRE(pos == db->m_file->tell());
+            test_object ob(nullptr);
+            db->load(&ob);
+            REQUIRE(ob.m_sid == obid);
+            REQUIRE(ob.m_hash == obhash);
+            db->goto_segment(1008);
+            db->load(&ob);
+            REQUIRE(ob.m_sid == obid2);
+            REQUIRE(ob.m_hash == obhash2);
+        }
+    }
+
+    SECTION("mmap_file instantiated dbs are readonly") {
+        long pos;
+        {
+            auto db = new_db();
+            db->begin_segment(1);
+            pos = db->m_file->tell();
+            db->store(test_object::make_random_unknown(nullptr).get());
+        }
+        REQUIRE_THROWS_AS((cq::db<uint256, cq::mmap_file>("/tmp/cq-db-tests", "cluster", 1008)), cq::db_error);
+        cq::db<uint256, cq::mmap_file> db("/tmp/cq-db-tests", "cluster", 1008, true);
+        db.load();
+        db.goto_segment(1);
+        REQUIRE(pos == db.m_file->tell());
+    }
+
     SECTION("storing then loading a single object") {
         auto db = new_db();
         db->begin_segment(1);
@@ -678,6 +910,183 @@ TEST_CASE("Database", "[db]") {
         REQUIRE(unknown == unknown_set);
     }
 
+    SECTION("unordered set of 20 known 20 unknown references, into vectors") {
+        auto db = new_db();
+        db->begin_segment(1);
+        cq::object<uint256>* ts[40];
+        std::vector<std::shared_ptr<test_object>> refs;
+        std::vector<cq::id> known_sids;
+        std::vector<uint256> unknown_hashes;
+        for (int i = 0; i < 40; ++i) {
+            auto ob = test_object::make_random_unknown(nullptr);
+            if (i & 1) known_sids.push_back(db->store(ob.get())); else unknown_hashes.push_back(ob->m_hash);
+            refs.push_back(ob);
+            ts[i] = ob.get();
+        }
+        // known references are on disk newest first; unknown ones in the order given
+        std::sort(known_sids.begin(), known_sids.end(), std::greater<cq::id>());
+
+        auto pos = db->m_file->tell();
+        db->refer(ts, 40);
+        db->refer(ts, 20);
+        auto end = db->m_file->tell();
+        db->m_file->seek(pos, SEEK_SET);
+        std::vector<cq::id> known;
+        std::vector<uint256> unknown;
+        db->derefer(known, unknown);
+        REQUIRE(known == known_sids);
+        REQUIRE(unknown == unknown_hashes);
+        // reusing the vectors overwrites them
+        auto capacity = known.capacity();
+        db->derefer(known, unknown);
+        REQUIRE(known.size() == 10);
+        REQUIRE(unknown.size() == 10);
+        REQUIRE(known.capacity() == capacity);
+        REQUIRE(std::vector<cq::id>(known_sids.end() - 10, known_sids.end()) == known);
+        REQUIRE(std::vector<uint256>(unknown_hashes.begin(), unknown_hashes.begin() + 10) == unknown);
+        REQUIRE(db->m_file->tell() == end);
+    }
+
+    SECTION("unordered set of 40000 known 30000 unknown references") {
+        // more than 65535 references in one set
+        auto db = new_db();
+        db->begin_segment(1);
+        std::vector<std::shared_ptr<test_object>> refs;
+        std::vector<cq::object<uint256>*> ts;
+        std::set<cq::id> known_set;
+        std::set<uint256> unknown_set;
+        for (int i = 0; i < 70000; ++i) {
+            auto ob = test_object::make_random_unknown(nullptr);
+            if (i < 40000) known_set.insert(db->store(ob.get())); else unknown_set.insert(ob->m_hash);
+            refs.push_back(ob);
+            ts.push_back(ob.get());
+        }
+        auto pos = db->m_file->tell();
+        db->refer(ts.data(), ts.size());
+        db->m_file->seek(pos, SEEK_SET);
+        std::set<cq::id> known;
+        std::set<uint256> unknown;
+        db->derefer(known, unknown);
+        REQUIRE(known == known_set);
+        REQUIRE(unknown == unknown_set);
+    }
+
+    SECTION("unordered set of 300 known references, sorted (v3) and unsorted (v2)") {
+        auto db = new_db();
+        db->begin_segment(1);
+        std::vector<std::shared_ptr<test_object>> refs;
+        std::set<cq::id> known_set;
+        for (int i = 0; i < 300; ++i) {
+            auto ob = test_object::make_random_unknown(nullptr);
+            known_set.insert(db->store(ob.get()));
+            refs.push_back(ob);
+        }
+        cq::object<uint256>* ts[300];
+        for (int i = 0; i < 300; ++i) ts[i] = refs[(i * 7) % 300].get();
+
+        long size[2];
+        for (int legacy = 0; legacy < 2; ++legacy) {
+            if (legacy) db->m_reg.m_back_index.reset(2, db->m_reg.m_back_index.m_cluster);
+            REQUIRE(db->get_back_index().get_version() == (legacy ? 2 : cq::HEADER_VERSION));
+            auto pos = db->m_file->tell();
+            db->refer(ts, 300);
+            size[legacy] = db->m_file->tell() - pos;
+            db->m_file->seek(pos, SEEK_SET);
+            std::set<cq::id> known;
+            std::set<uint256> unknown;
+            db->derefer(known, unknown);
+            REQUIRE(db->m_file->tell() == pos + size[legacy]);
+            REQUIRE(unknown.size() == 0);
+            REQUIRE(known == known_set);
+            db->m_file->seek(0, SEEK_END);
+        }
+        REQUIRE(size[0] < size[1]);
+    }
+
+    SECTION("interned unknown references") {
+        uint256 a, b, c;
+        cq::randomize(a.begin(), 32);
+        cq::randomize(b.begin(), 32);
+        cq::randomize(c.begin(), 32);
+        long start, first, repeat, set_start;
+        {
+            auto db = new_db();
+            // nothing is written to the first cluster yet, so it is interned as well
+            db->enable_interning();
+            REQUIRE(db->get_back_index().get_flags() == cq::HEADER_INTERNED);
+            db->begin_segment(1);
+            start = db->m_file->tell();
+            db->refer(a);
+            first = db->m_file->tell() - start;
+            db->refer(b);
+            long pos = db->m_file->tell();
+            db->refer(a);
+            repeat = db->m_file->tell() - pos;
+            set_start = db->m_file->tell();
+            std::set<uint256> hashes{a, b, c};
+            std::vector<cq::object<uint256>*> obs;
+            std::vector<std::shared_ptr<test_object>> objects;
+            for (const auto& h : hashes) {
+                objects.push_back(std::make_shared<test_object>(nullptr, h));
+                obs.push_back(objects.back().get());
+            }
+            db->refer(obs.data(), obs.size());
+            db->refer(c);
+        }
+        REQUIRE(first == 33);
+        REQUIRE(repeat < 4);
+        for (int from = 0; from < 2; ++from) {
+            // reading from the start, or from the reference set, whose hashes were first seen before it
+            auto db = open_db();
+            db->goto_segment(1);
+            REQUIRE(db->get_back_index().get_flags() == cq::HEADER_INTERNED);
+            uint256 h;
+            if (from == 0) {
+                REQUIRE(db->m_file->tell() == start);
+                REQUIRE(db->derefer(h) == a);
+                REQUIRE(db->derefer(h) == b);
+                REQUIRE(db->derefer(h) == a);
+            } else {
+                db->m_file->seek(set_start, SEEK_SET);
+            }
+            std::set<cq::id> known;
+            std::set<uint256> unknown;
+            db->derefer(known, unknown);
+            REQUIRE(known.size() == 0);
+            REQUIRE(unknown == std::set<uint256>{a, b, c});
+            REQUIRE(db->derefer(h) == c);
+            REQUIRE(db->m_file->eof());
+        }
+        {
+            // the db does not replay the cluster when resuming it, so hashes are written in full again
+            auto db = open_db();
+            db->begin_segment(2);
+            long pos = db->m_file->tell();
+            db->refer(b);
+            REQUIRE(db->m_file->tell() - pos == 33);
+            db->refer(b);
+            db->m_file->seek(pos, SEEK_SET);
+            uint256 h;
+            REQUIRE(db->derefer(h) == b);
+            REQUIRE(db->derefer(h) == b);
+        }
+        {
+            // clusters created without interning are left alone
+            auto db = new_db();
+            db->begin_segment(1);
+            db->refer(a);
+            db->enable_interning();
+            REQUIRE(db->get_back_index().get_flags() == 0);
+            long pos = db->m_file->tell();
+            db->refer(a);
+            REQUIRE(db->m_file->tell() - pos == 32);
+            // but new clusters are
+            db->begin_segment(1008);
+            REQUIRE(db->get_cluster() == 1);
+            REQUIRE(db->get_back_index().get_flags() == cq::HEADER_INTERNED);
+        }
+    }
+
     //     /**
     //      * Segments are important positions in the stream of events which are referencable
     //      * from the follow-up header. Segments must be strictly increasing, but may include
@@ -779,6 +1188,167 @@ TEST_CASE("Database", "[db]") {
         REQUIRE(ob3->m_sid == ob2.m_sid);
     }
 
+    SECTION("segment directory") {
+        std::map<cq::id, cq::id> positions;
+        {
+            auto db = new_db();
+            for (cq::id segment = 1; segment < 4000; segment += 250) {
+                db->begin_segment(segment);
+                positions[segment] = db->m_file->tell();
+                db->store(test_object::make_random_unknown(nullptr).get());
+            }
+            // the writer keeps its directory up to date
+            cq::registry::segment_location location;
+            REQUIRE(db->m_reg.find_segment(1, location));
+            db->begin_segment(4001);
+            positions[4001] = db->m_file->tell();
+            REQUIRE(db->m_reg.find_segment(4001, location));
+            REQUIRE(location.cluster == 3);
+            REQUIRE(location.position == positions[4001]);
+            REQUIRE(!db->m_reg.find_segment(2, location));
+        }
+        auto db = open_db();
+        for (const auto& kv : positions) {
+            cq::registry::segment_location location;
+            REQUIRE(db->m_reg.find_segment(kv.first, location));
+            REQUIRE(location.cluster == kv.first / 1008);
+            REQUIRE(location.position == kv.second);
+        }
+        // jumping within a cluster does not reopen it
+        db->goto_segment(1);
+        cq::file* file = db->m_ic.m_file;
+        db->goto_segment(751);
+        REQUIRE(db->m_ic.m_file == file);
+        REQUIRE(db->m_file->tell() == positions[751]);
+        db->goto_segment(3001);
+        REQUIRE(db->get_cluster() == 2);
+        REQUIRE(db->m_file->tell() == positions[3001]);
+    }
+
+    SECTION("cluster file cache") {
+        std::map<cq::id, std::shared_ptr<test_object>> objects;
+        {
+            auto db = new_db();
+            for (cq::id segment = 1; segment < 4100; segment += 1024) {
+                db->begin_segment(segment);
+                objects[segment] = test_object::make_random_unknown(nullptr);
+                db->store(objects[segment].get());
+            }
+        }
+        auto db = open_db();
+        auto visit = [&](cq::id segment) {
+            db->goto_segment(segment);
+            test_object ob(nullptr);
+            db->load(&ob);
+            REQUIRE(ob.m_hash == objects[segment]->m_hash);
+            return db->m_ic.m_file;
+        };
+        // ping-pong between clusters 0 and 1 only opens their files once
+        cq::file* f0 = visit(1);
+        cq::file* f1 = visit(1025);
+        auto misses = db->m_files.m_misses;
+        for (int i = 0; i < 4; ++i) {
+            REQUIRE(visit(1) == f0);
+            REQUIRE(visit(1025) == f1);
+        }
+        REQUIRE(db->m_files.m_misses == misses);
+        REQUIRE(db->get_back_index().m_cluster == 1);
+        REQUIRE(db->get_forward_index().m_cluster == 2);
+        REQUIRE(db->get_forward_index().has_segment(1025));
+        // the last cluster may still grow, so is never cached
+        visit(4097);
+        visit(1);
+        auto hits = db->m_files.m_hits;
+        visit(4097);
+        visit(1);
+        REQUIRE(db->m_files.m_hits == hits + 2); // cluster 0 and the forward index file of cluster 0
+        // files beyond the budget are closed
+        db->set_cache_size(1);
+        REQUIRE(db->m_files.size() <= 1);
+        visit(3073);
+        visit(2049);
+        REQUIRE(db->m_files.size() <= 1);
+        // as is everything when disabled
+        db->set_cache_size(0);
+        REQUIRE(db->m_files.size() <= 1); // the file in use
+        hits = db->m_files.m_hits;
+        visit(1);
+        visit(1025);
+        visit(1);
+        REQUIRE(db->m_files.m_hits == hits);
+        REQUIRE(db->m_files.size() == 0);
+    }
+
+    SECTION("cluster file cache, while the last cluster grows") {
+        for (uint8_t backend : {(uint8_t)cq::stdio_backend, (uint8_t)cq::posix_backend, (uint8_t)(cq::posix_backend | cq::mmap_backend)}) {
+            auto db = new_db("/tmp/cq-db-tests", backend);
+            std::map<cq::id, std::shared_ptr<test_object>> objects;
+            auto store = [&](cq::id segment) {
+                db->begin_segment(segment);
+                objects[segment] = test_object::make_random_unknown(nullptr);
+                db->store(objects[segment].get());
+            };
+            store(1);
+            store(1009);
+            // reads the forward index of cluster 0 from the file of cluster 1, which is still growing
+            db->goto_segment(1);
+            store(1010);
+            store(1011);
+            store(2017);
+            db->goto_segment(1011);
+            test_object ob(nullptr);
+            db->load(&ob);
+            REQUIRE(ob.m_sid == objects[1011]->m_sid);
+            REQUIRE(ob.m_hash == objects[1011]->m_hash);
+        }
+    }
+
+    SECTION("forward index log") {
+        std::string index_path;
+        long compact_size;
+        {
+            auto db = new_db();
+            index_path = db->m_reg.cluster_path(1);
+            db->begin_segment(1);
+            db->store(test_object::make_random_unknown(nullptr).get());
+            db->flush();
+            auto size = cq::fsize(index_path);
+            cq::file* index_file = db->m_ic.m_index_file;
+            REQUIRE(index_file);
+            // flushing without changes writes nothing
+            db->flush();
+            REQUIRE(cq::fsize(index_path) == size);
+            // each flush appends the new segments only, to the same open file
+            for (cq::id segment = 2; segment < 300; ++segment) {
+                db->begin_segment(segment);
+                db->store(test_object::make_random_unknown(nullptr).get());
+                db->flush();
+                REQUIRE(db->m_ic.m_index_file == index_file);
+                auto new_size = cq::fsize(index_path);
+                REQUIRE(new_size > size);
+                REQUIRE(new_size - size < 8);
+                size = new_size;
+            }
+            // a reader sees the log as it is
+            {
+                cq::db<uint256> reader("/tmp/cq-db-tests", "cluster", 1008, true);
+                reader.load();
+                REQUIRE(reader.get_forward_index().get_segment_count() == db->get_forward_index().get_segment_count());
+                REQUIRE(reader.get_forward_index().get_segment_position(299) == db->get_forward_index().get_segment_position(299));
+            }
+            // moving on to the next cluster compacts the index
+            db->begin_segment(1008);
+            REQUIRE(!db->m_ic.m_index_file);
+            compact_size = cq::fsize(cq::registry(nullptr, "/tmp/cq-db-tests", "cluster", 1008).cluster_path(1));
+            REQUIRE(compact_size < size);
+        }
+        auto db = open_db();
+        db->goto_segment(150);
+        REQUIRE(db->get_cluster() == 0);
+        REQUIRE(db->get_forward_index().get_segment_count() == 300);
+        REQUIRE(db->get_back_index().get_version() == cq::HEADER_VERSION);
+    }
+
     SECTION("segment jumping across three files with gap") {
         auto db = new_db();
         auto ob = test_object::make_random_unknown(nullptr);
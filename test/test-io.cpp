@@ -174,6 +174,279 @@ TEST_CASE("Streams", "[streams") {
         stream.read(&byte, 1);
         REQUIRE(byte == 1);
         REQUIRE(stream.eof());
+        // eof() does not probe the disk; appended data shows up after a reopen
+        {
+            cq::file appender(path, false);
+            appender.seek(0, SEEK_END);
+            byte = 2;
+            appender.w(byte);
+        }
+        REQUIRE(stream.eof());
+        stream.reopen();
+        REQUIRE(2 == stream.tell());
+        REQUIRE(!stream.eof());
+        REQUIRE(2 == stream.get_uint8());
+        REQUIRE(stream.eof());
+        // seeking is arithmetic; the stdio position follows before the next read or write,
+        // including when switching between the two without seeking in between
+        stream.seek(1, SEEK_SET);
+        byte = 5;
+        stream.w(byte);
+        REQUIRE(2 == stream.get_uint8());
+        stream.w(byte);
+        stream.seek(0, SEEK_SET);
+        stream.seek(3, SEEK_SET);
+        stream.seek(1, SEEK_SET);
+        REQUIRE(5 == stream.get_uint8());
+        REQUIRE(2 == stream.get_uint8());
+        REQUIRE(5 == stream.get_uint8());
+        REQUIRE(stream.eof());
+        // as after a failed read
+        REQUIRE_THROWS(stream.get_uint8());
+        stream.w(byte);
+        stream.seek(0, SEEK_SET);
+        uint8_t all[5];
+        stream.read(all, 5);
+        REQUIRE(0 == memcmp(all, "\x00\x05\x02\x05\x05", 5));
+    }
+    SECTION("posix-file-stream") {
+        std::string path = "/tmp/cq-io.cpp-test-posix-file-stream";
+        cq::rmfile(path);
+        {
+            cq::posix_file stream(path, false, false, 4);
+            uint8_t byte;
+            REQUIRE(0 == stream.tell());
+            REQUIRE(stream.eof());
+            REQUIRE_THROWS(stream.get_uint8());
+            stream.seek(1, SEEK_SET);
+            REQUIRE(stream.eof());
+            REQUIRE(0 == stream.tell());
+            byte = 0;
+            stream.w(byte);
+            REQUIRE(1 == stream.tell());
+            byte = 1;
+            stream.w(byte);
+            REQUIRE(2 == stream.tell());
+            // nothing has hit the disk yet
+            REQUIRE(0 == cq::fsize(path));
+            stream.seek(-1, SEEK_CUR);
+            REQUIRE(1 == stream.tell());
+            REQUIRE(!stream.eof());
+            stream.seek(-1, SEEK_CUR);
+            REQUIRE(0 == stream.tell());
+            REQUIRE(!stream.eof());
+            stream.seek(0, SEEK_END);
+            REQUIRE(2 == stream.tell());
+            REQUIRE(stream.eof());
+            stream.seek(-2, SEEK_END);
+            REQUIRE(0 == stream.tell());
+            stream.read(&byte, 1);
+            REQUIRE(byte == 0);
+            REQUIRE(!stream.eof());
+            stream.read(&byte, 1);
+            REQUIRE(byte == 1);
+            REQUIRE(stream.eof());
+            // overwriting, and writes larger than the buffer
+            stream.seek(1, SEEK_SET);
+            const uint8_t data[] = {2, 3, 4, 5, 6, 7, 8, 9};
+            stream.write(data, 8);
+            REQUIRE(9 == stream.tell());
+            stream.seek(0, SEEK_SET);
+            uint8_t buf[9];
+            stream.read(buf, 9);
+            REQUIRE(buf[0] == 0);
+            REQUIRE(0 == memcmp(&buf[1], data, 8));
+            REQUIRE_THROWS(stream.get_uint8());
+            REQUIRE(9 == stream.tell());
+        }
+        REQUIRE(9 == cq::fsize(path));
+        cq::posix_file stream(path, true);
+        REQUIRE(!stream.eof());
+        REQUIRE(0 == stream.get_uint8());
+        stream.seek(-1, SEEK_END);
+        REQUIRE(9 == stream.get_uint8());
+        REQUIRE(stream.eof());
+        // data appended elsewhere is not seen until reopen, whether read or viewed
+        {
+            cq::file appender(path, false);
+            appender.seek(0, SEEK_END);
+            const uint8_t more[] = {10, 11, 12};
+            appender.write(more, 3);
+        }
+        stream.seek(0, SEEK_SET);
+        size_t avail;
+        REQUIRE(stream.view(avail) != nullptr);
+        REQUIRE(avail == 9);
+        stream.seek(7, SEEK_SET);
+        uint8_t three[3];
+        REQUIRE(!stream.try_read(three, 3));
+        REQUIRE(7 == stream.tell());
+        REQUIRE(stream.try_read(three, 2));
+        REQUIRE(9 == stream.tell());
+        REQUIRE(stream.view(avail) == nullptr);
+        REQUIRE(avail == 0);
+        stream.reopen();
+        REQUIRE(10 == stream.get_uint8());
+    }
+    SECTION("ring-file-stream") {
+        std::string path = "/tmp/cq-io.cpp-test-ring-file-stream";
+        cq::rmfile(path);
+        std::vector<uint8_t> expected;
+        {
+            // a tiny ring, so that the writer has to wait for the I/O thread
+            cq::ring_file stream(path, false, 16);
+            REQUIRE(!stream.readonly());
+            REQUIRE(0 == stream.tell());
+            REQUIRE(stream.eof());
+            REQUIRE_THROWS(stream.get_uint8());
+            for (int i = 0; i < 1000; ++i) {
+                uint8_t byte = i & 0xff;
+                stream.w(byte);
+                expected.push_back(byte);
+            }
+            uint32_t word = 0x01020304;
+            for (int i = 0; i < 100; ++i) stream.w(word);
+            for (int i = 0; i < 100; ++i) expected.insert(expected.end(), (uint8_t*)&word, (uint8_t*)&word + 4);
+            REQUIRE((long)expected.size() == stream.tell());
+            stream.flush();
+            REQUIRE(0 == stream.pending());
+            REQUIRE((long)expected.size() == cq::fsize(path));
+            // reading back waits for the ring to drain
+            stream.w(word);
+            expected.insert(expected.end(), (uint8_t*)&word, (uint8_t*)&word + 4);
+            stream.seek(-4, SEEK_END);
+            uint32_t word2;
+            stream.r(word2);
+            REQUIRE(word2 == word);
+            REQUIRE(stream.eof());
+            // overwriting, and writes larger than the ring
+            stream.seek(1, SEEK_SET);
+            std::vector<uint8_t> data(40);
+            for (size_t i = 0; i < data.size(); ++i) data[i] = 200 + i;
+            stream.write(data.data(), data.size());
+            memcpy(&expected[1], data.data(), data.size());
+            REQUIRE(41 == stream.tell());
+            // appending continues from wherever the last write ended
+            uint8_t byte = 7;
+            stream.w(byte);
+            expected[41] = byte;
+            // reads come from a buffer, which writes over it invalidate
+            stream.seek(2, SEEK_SET);
+            size_t avail;
+            const uint8_t* view = stream.view(avail);
+            REQUIRE(avail == expected.size() - 2);
+            REQUIRE(view[0] == expected[2]);
+            byte = 9;
+            stream.w(byte);         // written directly, after which appends continue from 3
+            expected[2] = byte;
+            stream.seek(2, SEEK_SET);
+            REQUIRE(stream.get_uint8() == 9);
+            stream.w(byte);         // an append, but over the read buffer
+            expected[3] = byte;
+            stream.seek(3, SEEK_SET);
+            REQUIRE(stream.get_uint8() == 9);
+            stream.seek(0, SEEK_SET);
+            std::vector<uint8_t> buf(expected.size());
+            stream.read(buf.data(), buf.size());
+            REQUIRE(buf == expected);
+            stream.seek(0, SEEK_END);
+            stream.w(byte);
+            expected.push_back(byte);
+        }
+        // the destructor drains the ring
+        cq::file stream(path, true);
+        std::vector<uint8_t> buf(expected.size());
+        stream.read(buf.data(), buf.size());
+        REQUIRE(buf == expected);
+        REQUIRE(stream.eof());
+        // open_file picks the ring for writable files only
+        cq::file* f = cq::open_file(path, false, false, cq::ring_backend);
+        REQUIRE(dynamic_cast<cq::ring_file*>(f));
+        delete f;
+        f = cq::open_file(path, true, false, cq::ring_backend | cq::mmap_backend);
+        REQUIRE(dynamic_cast<cq::mmap_file*>(f));
+        delete f;
+    }
+    SECTION("mmap-file-stream") {
+        std::string path = "/tmp/cq-io.cpp-test-mmap-file-stream";
+        cq::rmfile(path);
+        {
+            cq::file stream(path, false);
+            for (uint8_t i = 0; i < 3; ++i) stream.w(i);
+            cq::varint(300).serialize(&stream);
+        }
+        cq::mmap_file stream(path);
+        uint8_t byte;
+        REQUIRE(stream.readonly());
+        REQUIRE(0 == stream.tell());
+        REQUIRE(!stream.eof());
+        REQUIRE_THROWS_AS(stream.w(byte), cq::io_error);
+        size_t avail;
+        const uint8_t* p = stream.view(avail);
+        REQUIRE(p != nullptr);
+        REQUIRE(avail == 5);
+        REQUIRE(p[0] == 0);
+        REQUIRE(p[2] == 2);
+        stream.skip(1);
+        REQUIRE(1 == stream.tell());
+        stream.read(&byte, 1);
+        REQUIRE(byte == 1);
+        stream.seek(-2, SEEK_END);
+        REQUIRE(300 == cq::varint::load(&stream));
+        REQUIRE(stream.eof());
+        REQUIRE(stream.view(avail) == nullptr);
+        REQUIRE(avail == 0);
+        REQUIRE_THROWS(stream.get_uint8());
+        stream.seek(10, SEEK_SET);
+        REQUIRE(5 == stream.tell());
+        // data appended after mapping is picked up on reopen
+        {
+            cq::file appender(path, false);
+            appender.seek(0, SEEK_END);
+            byte = 9;
+            appender.w(byte);
+        }
+        REQUIRE(stream.eof());
+        stream.reopen();
+        REQUIRE(!stream.eof());
+        REQUIRE(9 == stream.get_uint8());
+    }
+    SECTION("try_read") {
+        std::string path = "/tmp/cq-io.cpp-test-try-read";
+        cq::rmfile(path);
+        {
+            cq::file stream(path, false);
+            uint16_t u16 = 0x0102;
+            stream.w(u16);
+        }
+        cq::chv_stream chv;
+        chv.write((const uint8_t*)"\x02\x01", 2);
+        chv.seek(0, SEEK_SET);
+        std::vector<std::shared_ptr<cq::serializer>> streams{
+            std::make_shared<cq::file>(path, true),
+            std::make_shared<cq::posix_file>(path, true),
+            std::make_shared<cq::mmap_file>(path),
+        };
+        std::vector<cq::serializer*> all{&chv};
+        for (auto& stm : streams) all.push_back(stm.get());
+        for (cq::serializer* stream : all) {
+            uint8_t buf[3];
+            REQUIRE(!stream->try_read(buf, 3));
+            REQUIRE(0 == stream->tell());
+            REQUIRE(stream->try_read(buf, 1));
+            REQUIRE(buf[0] == 0x02);
+            REQUIRE(!stream->try_read(buf, 2));
+            REQUIRE(1 == stream->tell());
+            REQUIRE(stream->try_get_uint8(buf[0]));
+            REQUIRE(buf[0] == 0x01);
+            REQUIRE(!stream->try_get_uint8(buf[0]));
+            REQUIRE(2 == stream->tell());
+            cq::id value;
+            REQUIRE(!cq::varint::try_load(stream, value));
+            stream->seek(0, SEEK_SET);
+            REQUIRE(cq::varint::try_load(stream, value));
+            REQUIRE(value == 2);
+        }
     }
     SECTION("Vectors", "[vectors]") {
         std::vector<uint8_t> x{1,2,3};
@@ -307,6 +580,66 @@ TEST_CASE("Varints", "[varints]") {
         }
     }
 
+    SECTION("bulk encoding") {
+        // long runs of single byte values (the SIMD path), interspersed with multi-byte values
+        std::vector<cq::id> values;
+        for (cq::id i = 0; i < 4000; ++i) {
+            switch (i % 97) {
+                case 13: values.push_back(128); break;
+                case 40: values.push_back(i * 7919); break;
+                case 41: values.push_back(0xffffffffffffffffull - i); break;
+                case 90: values.push_back(16511); break;
+                default: values.push_back((i * 31) & 0x7f);
+            }
+        }
+        // encodes identically to one varint at a time
+        cq::chv_stream expected;
+        for (cq::id v : values) expected << cq::varint(v);
+        std::vector<uint8_t> buf(values.size() * 10);
+        size_t len = cq::varint::encode_many(values.data(), values.size(), buf.data());
+        REQUIRE(len == expected.get_chv().size());
+        REQUIRE(0 == memcmp(buf.data(), expected.get_chv().data(), len));
+        // decodes back
+        std::vector<cq::id> decoded(values.size());
+        size_t count = values.size();
+        REQUIRE(len == cq::varint::decode_many(buf.data(), len, decoded.data(), count));
+        REQUIRE(count == values.size());
+        REQUIRE(decoded == values);
+        // a truncated buffer stops before the partial varint
+        size_t partial = 0, last = 0;
+        for (size_t i = 0; i < 42; ++i) {
+            cq::varint v(values[i]);
+            last = cq::sizer(&v).tell();
+            partial += last;
+        }
+        REQUIRE(last == 10);
+        count = values.size();
+        REQUIRE(partial - last == cq::varint::decode_many(buf.data(), partial - 1, decoded.data(), count));
+        REQUIRE(count == 41);
+        // stream variants, with and without a view, and across buffer boundaries
+        {
+            cq::chv_stream stream;
+            cq::varint::encode_many(stream, values.data(), values.size());
+            REQUIRE(stream.get_chv() == expected.get_chv());
+            stream.seek(0, SEEK_SET);
+            std::fill(decoded.begin(), decoded.end(), 0);
+            cq::varint::decode_many(stream, decoded.data(), decoded.size());
+            REQUIRE(decoded == values);
+            REQUIRE(stream.eof());
+        }
+        std::string path = "/tmp/cq-io.cpp-test-bulk-varints";
+        for (int backend = 0; backend < 2; ++backend) {
+            cq::file* f = backend ? (cq::file*)new cq::posix_file(path, false, true, 16) : new cq::file(path, false, true);
+            cq::varint::encode_many(*f, values.data(), values.size());
+            f->seek(0, SEEK_SET);
+            std::fill(decoded.begin(), decoded.end(), 0);
+            cq::varint::decode_many(*f, decoded.data(), decoded.size());
+            REQUIRE(decoded == values);
+            REQUIRE(f->eof());
+            delete f;
+        }
+        cq::rmfile(path);
+    }
 }
 
 // we store two ordered series (ordered tuples if you will) in the specialized incmap construct
@@ -513,6 +846,26 @@ TEST_CASE("Incmaps", "[incmaps]") {
     }
 }
 
+TEST_CASE("Bitpacking", "[bitpacking]") {
+    // block and tail sizes around the BLOCK / MIN_TAIL boundaries, at various bit widths
+    size_t counts[] = {0, 1, 15, 16, 17, 127, 128, 129, 143, 144, 1000};
+    cq::id maxes[] = {0, 1, 2, 127, 255, 65535, 0xffffffffffffffull, 0x1ffffffffffffffull, 0xffffffffffffffffull};
+    for (size_t count : counts) {
+        for (cq::id max : maxes) {
+            std::vector<cq::id> values(count), decoded(count);
+            for (size_t i = 0; i < count; ++i) values[i] = max ? (i == count / 2 ? max : (i * 2654435761ull) % max) : 0;
+            cq::chv_stream stream;
+            cq::bitpacked::encode(&stream, values.data(), count);
+            stream << cq::varint(12345); // trailing data must be left alone
+            stream.seek(0, SEEK_SET);
+            cq::bitpacked::decode(&stream, decoded.data(), count);
+            REQUIRE(decoded == values);
+            REQUIRE(12345 == cq::varint::load(&stream));
+            REQUIRE(stream.eof());
+        }
+    }
+}
+
 TEST_CASE("Unordered set", "[unordered_set]") {
     SECTION("empty") {
         cq::unordered_set set;
@@ -841,6 +1194,25 @@ TEST_CASE("Clusters", "[clusters]") {
             buf[len] = 0;
             REQUIRE(std::string(buf) == string);
         }
+        {
+            // the non-throwing read path moves across clusters the same way
+            uint32_t u32x;
+            uint64_t u64x;
+            restartd(cd, c);
+            c->open(0, true);
+            REQUIRE(c->try_read((uint8_t*)&u32x, sizeof(u32x)));
+            REQUIRE(u32 == u32x);
+            REQUIRE(c->try_read((uint8_t*)&u64x, sizeof(u64x)));
+            REQUIRE(u64 == u64x);
+            REQUIRE(c->m_cluster == 0);
+            uint8_t len;
+            REQUIRE(c->try_get_uint8(len));
+            REQUIRE(c->m_cluster == 1);
+            REQUIRE(len == strlen(string));
+            c->skip(len);
+            REQUIRE(!c->try_get_uint8(len));
+            REQUIRE_THROWS_AS(c->get_uint8(), cq::io_error);
+        }
     }
 
     //     void seek(long offset, int whence) override;